@@ -8,1113 +8,4862 @@
 #include <sstream>
 #include <cctype>
 #include <memory>
+#include <charconv>
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <csignal>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define SHAPES_HAVE_SSE2 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#define NOGDI // wingdi.h declares a Rectangle function
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+// Performance counters ('stats') are built in unless this is defined
+#ifndef SHAPES_BLACKBOARD_NO_STATS
+#define SHAPES_STATS 1
+#else
+#define SHAPES_STATS 0
+#endif
 const double PI = 3.14159265358979323846;
 
 using namespace std;
 
-const int BOARD_WIDTH = 80;
-const int BOARD_HEIGHT = 25;
+// Size of a new board; 'resize' changes it at runtime.
+const int DEFAULT_BOARD_WIDTH = 80;
+const int DEFAULT_BOARD_HEIGHT = 25;
+const long long MAX_BOARD_CELLS = 1LL << 30;
+// Shape IDs index a dense slot table, so IDs read from files stay below
+// this; a corrupt ID must not allocate gigabytes.
+const int MAX_SHAPE_IDS = 1 << 24;
 
 std::string red = "\033[31m";
 std::string green = "\033[32m";
 std::string yellow = "\033[33m";
 std::string blue = "\033[34m";
 
+const uint16_t NO_COLOR = 0xFFFF;
 
-class Shapes {
-protected:
-    int id;
+// A single board cell: the glyph plus a palette handle. ANSI escapes are only
+// produced when the board is printed, so cells stay small and trivially copyable.
+struct Cell {
+    char glyph;
+    uint8_t reserved; // Always 0, so the cell kernels can compare whole cells
+    uint16_t color;
+};
+
+const Cell EMPTY_CELL = { ' ', 0, NO_COLOR };
+
+inline bool operator==(const Cell& a, const Cell& b) {
+    return a.glyph == b.glyph && a.color == b.color;
+}
+inline bool operator!=(const Cell& a, const Cell& b) {
+    return !(a == b);
+}
+
+// Bulk cell kernels used for clearing, span fills and frame comparison.
+// cellKernels() picks the widest implementation the CPU supports (AVX2,
+// SSE2 or scalar) the first time it is called.
+static_assert(sizeof(Cell) == sizeof(uint32_t), "cell kernels treat a Cell as one 32-bit lane");
+
+struct CellKernels {
+    const char* name;
+    void (*fill)(Cell* dst, size_t count, Cell value);
+    size_t (*mismatch)(const Cell* a, const Cell* b, size_t count); // First differing index, or count
+};
+
+inline uint32_t cellBits(Cell c) {
+    uint32_t bits;
+    memcpy(&bits, &c, sizeof(bits));
+    return bits;
+}
+
+inline unsigned lowestSetBit(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+void fillCellsScalar(Cell* dst, size_t count, Cell value) {
+    std::fill(dst, dst + count, value);
+}
+
+size_t mismatchCellsScalar(const Cell* a, const Cell* b, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+    }
+    return count;
+}
+
+#ifdef SHAPES_HAVE_SSE2
+void fillCellsSse2(Cell* dst, size_t count, Cell value) {
+    const __m128i pattern = _mm_set1_epi32(static_cast<int>(cellBits(value)));
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), pattern);
+    }
+    fillCellsScalar(dst + i, count - i, value);
+}
+
+size_t mismatchCellsSse2(const Cell* a, const Cell* b, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        uint32_t equal = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi32(va, vb)));
+        if (equal != 0xFFFFu) {
+            return i + lowestSetBit(~equal) / sizeof(Cell);
+        }
+    }
+    return i + mismatchCellsScalar(a + i, b + i, count - i);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SHAPES_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SHAPES_TARGET_AVX2
+#endif
+
+SHAPES_TARGET_AVX2 void fillCellsAvx2(Cell* dst, size_t count, Cell value) {
+    const __m256i pattern = _mm256_set1_epi32(static_cast<int>(cellBits(value)));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), pattern);
+    }
+    fillCellsSse2(dst + i, count - i, value);
+}
+
+SHAPES_TARGET_AVX2 size_t mismatchCellsAvx2(const Cell* a, const Cell* b, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        uint32_t equal = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi32(va, vb)));
+        if (equal != 0xFFFFFFFFu) {
+            return i + lowestSetBit(~equal) / sizeof(Cell);
+        }
+    }
+    return i + mismatchCellsSse2(a + i, b + i, count - i);
+}
+
+bool cpuHasAvx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) {
+        return false; // OS does not save YMM registers
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+const CellKernels& cellKernels() {
+    static const CellKernels kernels = []() -> CellKernels {
+#ifdef SHAPES_HAVE_SSE2
+        if (cpuHasAvx2()) {
+            return { "avx2", fillCellsAvx2, mismatchCellsAvx2 };
+        }
+        return { "sse2", fillCellsSse2, mismatchCellsSse2 };
+#else
+        return { "scalar", fillCellsScalar, mismatchCellsScalar };
+#endif
+    }();
+    return kernels;
+}
+
+// Style handles. Color and fill-mode names are interned once, when a
+// command or file is parsed; shapes and cells only keep the handles.
+using ColorId = uint16_t;
+using FillId = uint16_t;
+
+enum class FillMode : uint8_t {
+    Fill,   // "fill"
+    Frame,  // "frame"
+    Other   // Any other name: drawn as an outline, circles not at all
+};
+
+struct ShapeStyle {
+    ColorId color;
+    FillId fill;
+};
+
+struct Rgb {
+    uint8_t r, g, b;
+};
+
+const Rgb DEFAULT_INK = { 229, 229, 229 };  // Cells without a known color, as on a dark terminal
+
+// Every color and fill-mode name seen so far, shared by the whole program.
+// A color's glyph and ANSI escape are worked out once, when it is interned:
+// the eight basic names, "color0".."color255" from the 256-color palette
+// and "#rrggbb" truecolor, along with the RGB value images use (xterm's
+// defaults for the palette colors). Other names are kept, so they still
+// list and save as typed, but are drawn without an escape code.
+// Entries live in fixed chunks and never move, so threads drawing a
+// published snapshot can read them while new names are interned; only
+// interning needs the single command thread.
+class Palette {
+private:
+    struct Color {
+        string name;
+        string escape;  // Empty if the name is not a color the terminal knows
+        Cell symbol;
+        Rgb rgb;
+    };
+    struct Fill {
+        string name;
+        FillMode mode;
+    };
+    static const size_t MAX_NAMES = NO_COLOR; // Handles stay below NO_COLOR
+    static const size_t CHUNK = 256;
+
+    unique_ptr<Color[]> colors[MAX_NAMES / CHUNK + 1];
+    unique_ptr<Fill[]> fills[MAX_NAMES / CHUNK + 1];
+    size_t colorCount;
+    size_t fillCount;
+    unordered_map<string, ColorId> colorIds;
+    unordered_map<string, FillId> fillIds;
+    string reset;
+
+    const Color& color(ColorId id) const { return colors[id / CHUNK][id % CHUNK]; }
+    const Fill& fill(FillId id) const { return fills[id / CHUNK][id % CHUNK]; }
+
+    static bool parseByte(std::string_view digits, int base, int& value) {
+        auto result = std::from_chars(digits.data(), digits.data() + digits.size(), value, base);
+        return !digits.empty() && result.ec == std::errc() && result.ptr == digits.data() + digits.size() && value >= 0 && value <= 255;
+    }
+    static string escapeFor(std::string_view name) {
+        static const char* const basic[] = { "black", "red", "green", "yellow", "blue", "magenta", "cyan", "white" };
+        for (int i = 0; i < 8; ++i) {
+            if (name == basic[i]) {
+                return "\033[3" + to_string(i) + "m";
+            }
+        }
+        int r, g, b;
+        if (name.size() > 5 && name.substr(0, 5) == "color" && parseByte(name.substr(5), 10, r)) {
+            return "\033[38;5;" + to_string(r) + "m";
+        }
+        if (name.size() == 7 && name[0] == '#' &&
+            parseByte(name.substr(1, 2), 16, r) && parseByte(name.substr(3, 2), 16, g) && parseByte(name.substr(5, 2), 16, b)) {
+            return "\033[38;2;" + to_string(r) + ";" + to_string(g) + ";" + to_string(b) + "m";
+        }
+        return "";
+    }
+    // Color n of the xterm 256-color palette.
+    static Rgb paletteRgb(int n) {
+        static const Rgb system[16] = {
+            { 0, 0, 0 }, { 205, 0, 0 }, { 0, 205, 0 }, { 205, 205, 0 }, { 0, 0, 238 }, { 205, 0, 205 }, { 0, 205, 205 }, { 229, 229, 229 },
+            { 127, 127, 127 }, { 255, 0, 0 }, { 0, 255, 0 }, { 255, 255, 0 }, { 92, 92, 255 }, { 255, 0, 255 }, { 0, 255, 255 }, { 255, 255, 255 }
+        };
+        if (n < 16) {
+            return system[n];
+        }
+        if (n >= 232) {
+            uint8_t level = static_cast<uint8_t>(8 + 10 * (n - 232));
+            return { level, level, level };
+        }
+        static const uint8_t cube[6] = { 0, 95, 135, 175, 215, 255 };
+        n -= 16;
+        return { cube[n / 36], cube[n / 6 % 6], cube[n % 6] };
+    }
+    static Rgb rgbFor(std::string_view name) {
+        static const char* const basic[] = { "black", "red", "green", "yellow", "blue", "magenta", "cyan", "white" };
+        for (int i = 0; i < 8; ++i) {
+            if (name == basic[i]) {
+                return paletteRgb(i);
+            }
+        }
+        int r, g, b;
+        if (name.size() > 5 && name.substr(0, 5) == "color" && parseByte(name.substr(5), 10, r)) {
+            return paletteRgb(r);
+        }
+        if (name.size() == 7 && name[0] == '#' &&
+            parseByte(name.substr(1, 2), 16, r) && parseByte(name.substr(3, 2), 16, g) && parseByte(name.substr(5, 2), 16, b)) {
+            return { static_cast<uint8_t>(r), static_cast<uint8_t>(g), static_cast<uint8_t>(b) };
+        }
+        return DEFAULT_INK;
+    }
+public:
+    Palette() : colorCount(0), fillCount(0), reset("\033[0m") {}
+
+    // False only if the table is full.
+    bool internColor(std::string_view name, ColorId& id) {
+        string key(name);
+        auto it = colorIds.find(key);
+        if (it != colorIds.end()) {
+            id = it->second;
+            return true;
+        }
+        if (colorCount >= MAX_NAMES) {
+            return false;
+        }
+        id = static_cast<ColorId>(colorCount++);
+        if (!colors[id / CHUNK]) {
+            colors[id / CHUNK].reset(new Color[CHUNK]);
+        }
+        Color& color = colors[id / CHUNK][id % CHUNK];
+        color.escape = escapeFor(name);
+        color.rgb = rgbFor(name);
+        color.symbol.glyph = name.empty() ? '*' : name[0]; // Default symbol
+        color.symbol.reserved = 0;
+        color.symbol.color = color.escape.empty() ? NO_COLOR : id;
+        color.name = key;
+        colorIds.emplace(std::move(key), id);
+        return true;
+    }
+    bool internFill(std::string_view name, FillId& id) {
+        string key(name);
+        auto it = fillIds.find(key);
+        if (it != fillIds.end()) {
+            id = it->second;
+            return true;
+        }
+        if (fillCount >= MAX_NAMES) {
+            return false;
+        }
+        id = static_cast<FillId>(fillCount++);
+        if (!fills[id / CHUNK]) {
+            fills[id / CHUNK].reset(new Fill[CHUNK]);
+        }
+        FillMode mode = name == "fill" ? FillMode::Fill : name == "frame" ? FillMode::Frame : FillMode::Other;
+        fills[id / CHUNK][id % CHUNK] = { key, mode };
+        fillIds.emplace(std::move(key), id);
+        return true;
+    }
+    bool intern(std::string_view color, std::string_view fill, ShapeStyle& style) {
+        return internColor(color, style.color) && internFill(fill, style.fill);
+    }
+
+    const string& colorName(ColorId id) const { return color(id).name; }
+    const string& fillName(FillId id) const { return fill(id).name; }
+    FillMode fillMode(FillId id) const { return fill(id).mode; }
+    Cell symbol(ColorId id) const { return color(id).symbol; }
+    // Escape that switches the terminal to a cell's color
+    const string& escape(ColorId ink) const {
+        return ink == NO_COLOR ? reset : color(ink).escape;
+    }
+    Rgb rgb(ColorId ink) const {
+        return ink == NO_COLOR ? DEFAULT_INK : color(ink).rgb;
+    }
+};
+
+Palette& palette() {
+    static Palette instance;
+    return instance;
+}
+
+// Axis-aligned cell rectangle; right and bottom are exclusive.
+struct Rect {
+    int left, top, right, bottom;
+
+    bool empty() const { return left >= right || top >= bottom; }
+    bool contains(int x, int y) const {
+        return x >= left && x < right && y >= top && y < bottom;
+    }
+    bool covers(const Rect& other) const {
+        return other.left >= left && other.right <= right && other.top >= top && other.bottom <= bottom;
+    }
+    bool intersects(const Rect& other) const {
+        return left < other.right && other.left < right && top < other.bottom && other.top < bottom;
+    }
+    Rect intersected(const Rect& other) const {
+        return { max(left, other.left), max(top, other.top), min(right, other.right), min(bottom, other.bottom) };
+    }
+    Rect united(const Rect& other) const {
+        if (empty()) return other;
+        if (other.empty()) return *this;
+        return { min(left, other.left), min(top, other.top), max(right, other.right), max(bottom, other.bottom) };
+    }
+};
+
+const int32_t NO_SHAPE = -1;
+
+// Clipped window onto a framebuffer; this is what shapes draw into. Every
+// written cell also records the ID of the shape being drawn. Writes outside
+// the clip rectangle are dropped, so several views with disjoint clips can
+// be filled from different threads. A probe target has no storage and only
+// notes whether anything was drawn inside its clip.
+class RasterTarget {
+private:
+    Cell* cells;
+    int32_t* ids;
+    int width;
+    Rect clip;
+    int32_t shapeId;
+    bool hit;
+#if SHAPES_STATS
+    uint64_t written;  // Cells stored so far
+#endif
+public:
+    RasterTarget(Cell* c, int32_t* i, int w, const Rect& r) : cells(c), ids(i), width(w), clip(r), shapeId(NO_SHAPE), hit(false) {
+#if SHAPES_STATS
+        written = 0;
+#endif
+    }
+    static RasterTarget probe(int x, int y) {
+        return RasterTarget(nullptr, nullptr, 0, { x, y, x + 1, y + 1 });
+    }
+    const Rect& getClip() const { return clip; }
+#if SHAPES_STATS
+    uint64_t getWritten() const { return written; }
+#endif
+    void setShape(int32_t id) { shapeId = id; }
+    bool wasHit() const { return hit; }
+    bool contains(int x, int y) const {
+        return clip.contains(x, y);
+    }
+    void set(int x, int y, Cell c) {
+        if (!contains(x, y)) {
+            return;
+        }
+        if (!cells) {
+            hit = true;
+            return;
+        }
+        size_t offset = static_cast<size_t>(y) * width + x;
+        cells[offset] = c;
+        ids[offset] = shapeId;
+#if SHAPES_STATS
+        ++written;
+#endif
+    }
+    // Fills cells [x0, x1) of row y, clipped once for the whole span.
+    void fillSpan(int y, int x0, int x1, Cell c) {
+        if (y < clip.top || y >= clip.bottom) {
+            return;
+        }
+        x0 = max(x0, clip.left);
+        x1 = min(x1, clip.right);
+        if (x0 >= x1) {
+            return;
+        }
+        if (!cells) {
+            hit = true;
+            return;
+        }
+        size_t offset = static_cast<size_t>(y) * width;
+        cellKernels().fill(cells + offset + x0, x1 - x0, c);
+        std::fill(ids + offset + x0, ids + offset + x1, shapeId);
+#if SHAPES_STATS
+        written += x1 - x0;
+#endif
+    }
+    // Offsets [first, last) of the rows starting at y that fall inside the clip.
+    void clipRows(int y, int rows, int& first, int& last) const {
+        first = max(0, clip.top - y);
+        last = min(rows, clip.bottom - y);
+    }
+};
+
+// Flat, row-major framebuffer that all shapes rasterize into, with a
+// parallel buffer holding the ID of the top-most shape drawn in each cell.
+class FrameBuffer {
+private:
+    int width, height;
+    vector<Cell> cells;
+    vector<int32_t> ids;
+public:
+    FrameBuffer(int w, int h) : width(w), height(h), cells(static_cast<size_t>(w) * h, EMPTY_CELL), ids(static_cast<size_t>(w) * h, NO_SHAPE) {}
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    Rect bounds() const { return { 0, 0, width, height }; }
+    RasterTarget view(const Rect& clip) {
+        return RasterTarget(cells.data(), ids.data(), width, clip.intersected(bounds()));
+    }
+    void clear(const Rect& r) {
+        Rect area = r.intersected(bounds());
+        if (area.empty()) {
+            return;
+        }
+        if (area.left == 0 && area.right == width) {
+            // Whole rows are contiguous: clear them in one pass
+            size_t start = static_cast<size_t>(area.top) * width;
+            size_t count = static_cast<size_t>(area.bottom - area.top) * width;
+            cellKernels().fill(cells.data() + start, count, EMPTY_CELL);
+            std::fill(ids.begin() + start, ids.begin() + start + count, NO_SHAPE);
+            return;
+        }
+        for (int y = area.top; y < area.bottom; ++y) {
+            size_t start = static_cast<size_t>(y) * width + area.left;
+            cellKernels().fill(cells.data() + start, area.right - area.left, EMPTY_CELL);
+            std::fill(ids.begin() + start, ids.begin() + start + (area.right - area.left), NO_SHAPE);
+        }
+    }
+    const Cell& at(int x, int y) const {
+        return cells[static_cast<size_t>(y) * width + x];
+    }
+    const Cell* row(int y) const {
+        return cells.data() + static_cast<size_t>(y) * width;
+    }
+    void clear() {
+        cellKernels().fill(cells.data(), cells.size(), EMPTY_CELL);
+        std::fill(ids.begin(), ids.end(), NO_SHAPE);
+    }
+    int32_t shapeAt(int x, int y) const {
+        return ids[static_cast<size_t>(y) * width + x];
+    }
+    // IDs of the shapes visible anywhere in the area, ascending.
+    vector<int32_t> shapesIn(const Rect& r) const {
+        Rect area = r.intersected(bounds());
+        vector<int32_t> found;
+        for (int y = area.top; y < area.bottom; ++y) {
+            const int32_t* rowIds = ids.data() + static_cast<size_t>(y) * width;
+            int32_t previous = NO_SHAPE;
+            for (int x = area.left; x < area.right; ++x) {
+                if (rowIds[x] != previous && rowIds[x] != NO_SHAPE) {
+                    found.push_back(rowIds[x]);
+                }
+                previous = rowIds[x];
+            }
+        }
+        sort(found.begin(), found.end());
+        found.erase(unique(found.begin(), found.end()), found.end());
+        return found;
+    }
+    void copySpan(const FrameBuffer& from, int y, int x0, int x1) {
+        std::copy(from.row(y) + x0, from.row(y) + x1, cells.data() + static_cast<size_t>(y) * width + x0);
+    }
+    // Copies count cells into row y, starting at column x.
+    void putSpan(int y, int x, const Cell* from, int count) {
+        std::copy(from, from + count, cells.data() + static_cast<size_t>(y) * width + x);
+    }
+    // Index of the first cell in row y, columns [x0, x1), that differs from
+    // the same cell in other (same size); x1 if the span matches.
+    int firstDifference(const FrameBuffer& other, int y, int x0, int x1) const {
+        return x0 + static_cast<int>(cellKernels().mismatch(row(y) + x0, other.row(y) + x0, x1 - x0));
+    }
+};
+
+// Zoomed-out copies of a framebuffer. Level k has one cell per 2^k x 2^k
+// block of the board: the first non-empty one of the block's four quarters
+// on level k - 1 (top-left, top-right, bottom-left, bottom-right), so thin
+// lines survive zooming out. Level 0 is the framebuffer itself. Levels are
+// built the first time a view needs them, then updated one repainted area
+// at a time.
+class MipChain {
+private:
+    struct Level {
+        int width, height;
+        vector<Cell> cells;
+    };
+    vector<Level> levels;  // levels[k - 1] is level k
+
+    // Recomputes area, in level k cells, from level k - 1.
+    void downsample(const FrameBuffer& base, int k, const Rect& area) {
+        Level& level = levels[k - 1];
+        int sourceWidth = getWidth(base, k - 1);
+        int sourceHeight = getHeight(base, k - 1);
+        for (int y = area.top; y < area.bottom; ++y) {
+            const Cell* upper = row(base, k - 1, 2 * y);
+            const Cell* lower = 2 * y + 1 < sourceHeight ? row(base, k - 1, 2 * y + 1) : nullptr;
+            Cell* out = level.cells.data() + static_cast<size_t>(y) * level.width;
+            for (int x = area.left; x < area.right; ++x) {
+                int sx = 2 * x;
+                bool right = sx + 1 < sourceWidth;
+                Cell c = upper[sx];
+                if (c == EMPTY_CELL && right) c = upper[sx + 1];
+                if (c == EMPTY_CELL && lower) c = lower[sx];
+                if (c == EMPTY_CELL && lower && right) c = lower[sx + 1];
+                out[x] = c;
+            }
+        }
+    }
+public:
+    int depth() const { return static_cast<int>(levels.size()); }
+    int getWidth(const FrameBuffer& base, int k) const { return k == 0 ? base.getWidth() : levels[k - 1].width; }
+    int getHeight(const FrameBuffer& base, int k) const { return k == 0 ? base.getHeight() : levels[k - 1].height; }
+    const Cell* row(const FrameBuffer& base, int k, int y) const {
+        return k == 0 ? base.row(y) : levels[k - 1].cells.data() + static_cast<size_t>(y) * levels[k - 1].width;
+    }
+    void clear() { levels.clear(); }
+    // Builds the levels up to depth that do not exist yet.
+    void build(const FrameBuffer& base, int depth) {
+        for (int k = this->depth() + 1; k <= depth; ++k) {
+            int width = (getWidth(base, k - 1) + 1) / 2;
+            int height = (getHeight(base, k - 1) + 1) / 2;
+            levels.push_back({ width, height, vector<Cell>(static_cast<size_t>(width) * height, EMPTY_CELL) });
+            downsample(base, k, { 0, 0, width, height });
+        }
+    }
+    // Brings every level up to date after area of the base was repainted.
+    void update(const FrameBuffer& base, Rect area) {
+        for (int k = 1; k <= depth(); ++k) {
+            area = { area.left / 2, area.top / 2, (area.right + 1) / 2, (area.bottom + 1) / 2 };
+            downsample(base, k, area);
+        }
+    }
+};
+
+// Turns a framebuffer into terminal output. Each frame is built in one
+// buffer and written at once, with a color escape only where the color
+// changes. In live mode the board stays at the top of the screen and only
+// the cells that changed since the previous frame are rewritten, using
+// cursor addressing.
+class TerminalRenderer {
+private:
+    string out;
+    FrameBuffer shown;  // Last frame written in live mode
+    bool live;
+    bool hasShown;
+    ColorId current;    // Color the terminal is set to while building a frame
+
+    static const int MIN_GAP = 8; // Unchanged cells worth skipping with a cursor move
+
+    void setColor(ColorId color) {
+        if (color == current) {
+            return;
+        }
+        out += palette().escape(color);
+        current = color;
+    }
+    void appendCells(const Cell* cells, int count) {
+        for (int i = 0; i < count; ++i) {
+            setColor(cells[i].color);
+            out += cells[i].glyph;
+        }
+    }
+    void appendBorder(int width) {
+        setColor(NO_COLOR);
+        out += '+';
+        out.append(width, '-');
+        out += "+\n";
+    }
+    void moveTo(int row, int col) {
+        out += "\033[";
+        out += to_string(row);
+        out += ';';
+        out += to_string(col);
+        out += 'H';
+    }
+    void appendFull(const FrameBuffer& frame) {
+        appendBorder(frame.getWidth());
+        for (int y = 0; y < frame.getHeight(); ++y) {
+            out += '|';
+            appendCells(frame.row(y), frame.getWidth());
+            setColor(NO_COLOR);
+            out += "|\n";
+        }
+        appendBorder(frame.getWidth());
+    }
+    // Rewrites the changed runs of each row; the border sits at row 1 and
+    // column 1, so cell (x, y) is at screen position (y + 2, x + 2).
+    void appendChanges(const FrameBuffer& frame) {
+        int width = frame.getWidth();
+        for (int y = 0; y < frame.getHeight(); ++y) {
+            const Cell* now = frame.row(y);
+            const Cell* before = shown.row(y);
+            int x = 0;
+            while (x < width) {
+                int start = frame.firstDifference(shown, y, x, width);
+                if (start == width) {
+                    break;
+                }
+                int end = start + 1;
+                int gap = 0;
+                while (end < width && gap < MIN_GAP) {
+                    gap = now[end] == before[end] ? gap + 1 : 0;
+                    ++end;
+                }
+                end -= gap;
+                moveTo(y + 2, start + 2);
+                appendCells(now + start, end - start);
+                shown.copySpan(frame, y, start, end);
+                x = end;
+            }
+        }
+        setColor(NO_COLOR);
+        moveTo(frame.getHeight() + 3, 1);
+        out += "\033[J"; // Clear old command output below the board
+    }
+public:
+    TerminalRenderer() : shown(0, 0), live(false), hasShown(false), current(NO_COLOR) {}
+    bool isLive() const { return live; }
+    void setLive(bool on) {
+        live = on;
+        hasShown = false;
+        shown = FrameBuffer(0, 0);
+    }
+    void print(const FrameBuffer& frame, ostream& os) {
+        out.clear();
+        current = NO_COLOR;
+        if (!live) {
+            appendFull(frame);
+        }
+        else if (hasShown && shown.getWidth() == frame.getWidth() && shown.getHeight() == frame.getHeight()) {
+            appendChanges(frame);
+        }
+        else {
+            out += "\033[H\033[2J";
+            appendFull(frame);
+            shown = frame;
+            hasShown = true;
+        }
+        os.write(out.data(), out.size());
+        os.flush();
+    }
+};
+
+enum class ImageFormat {
+    Ppm,  // Binary PPM (P6)
+    Png   // 8-bit RGB, deflate with stored blocks only
+};
+
+const Rgb IMAGE_BACKGROUND = { 0, 0, 0 };
+const int MAX_IMAGE_SCALE = 64;
+
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size) {
+    static const vector<uint32_t> table = []() {
+        vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t adler32(uint32_t adler, const uint8_t* data, size_t size) {
+    const uint32_t MOD = 65521;
+    const size_t MAX_RUN = 5552; // Longest run whose sums cannot overflow
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (size > 0) {
+        size_t run = min(size, MAX_RUN);
+        for (size_t i = 0; i < run; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= MOD;
+        b %= MOD;
+        data += run;
+        size -= run;
+    }
+    return (b << 16) | a;
+}
+
+// Writes an image one pixel row at a time; nothing but the current row is
+// kept. A PNG gets one IDAT chunk per row, holding that row as stored
+// deflate blocks, so every chunk length is known before it is written.
+class ImageWriter {
+private:
+    ostream& out;
+    ImageFormat format;
+    uint32_t width, height;
+    uint32_t rows;          // Written so far
+    uint32_t adler;         // Of the uncompressed PNG data
+    vector<uint8_t> chunk;  // PNG chunk being built: length, type, data
+
+    static constexpr size_t MAX_STORED_BLOCK = 65535;
+
+    void be32(uint32_t v) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            chunk.push_back(static_cast<uint8_t>(v >> shift));
+        }
+    }
+    void beginChunk(const char* type) {
+        chunk.clear();
+        be32(0); // Length, filled in by endChunk
+        chunk.insert(chunk.end(), type, type + 4);
+    }
+    void endChunk() {
+        uint32_t length = static_cast<uint32_t>(chunk.size() - 8);
+        for (int i = 0; i < 4; ++i) {
+            chunk[i] = static_cast<uint8_t>(length >> (24 - 8 * i));
+        }
+        be32(crc32(0, chunk.data() + 4, chunk.size() - 4));
+        out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    }
+    void storedBlock(const uint8_t* data, size_t size, bool final) {
+        chunk.push_back(final ? 1 : 0); // BFINAL, BTYPE 00
+        chunk.push_back(static_cast<uint8_t>(size));
+        chunk.push_back(static_cast<uint8_t>(size >> 8));
+        chunk.push_back(static_cast<uint8_t>(~size));
+        chunk.push_back(static_cast<uint8_t>(~size >> 8));
+        chunk.insert(chunk.end(), data, data + size);
+        adler = adler32(adler, data, size);
+    }
+public:
+    // width and height are in pixels and must not be 0.
+    ImageWriter(ostream& o, ImageFormat f, uint32_t w, uint32_t h) : out(o), format(f), width(w), height(h), rows(0), adler(1) {
+        if (format == ImageFormat::Ppm) {
+            out << "P6\n" << width << " " << height << "\n255\n";
+            return;
+        }
+        static const char signature[8] = { '\x89', 'P', 'N', 'G', '\r', '\n', '\x1A', '\n' };
+        out.write(signature, sizeof(signature));
+        beginChunk("IHDR");
+        be32(width);
+        be32(height);
+        chunk.insert(chunk.end(), { 8, 2, 0, 0, 0 }); // 8 bits per sample, RGB, deflate, no filter, not interlaced
+        endChunk();
+    }
+
+    // row holds width pixels, 3 bytes each, after one spare byte the PNG
+    // filter type goes into.
+    void writeRow(vector<uint8_t>& row) {
+        ++rows;
+        if (format == ImageFormat::Ppm) {
+            out.write(reinterpret_cast<const char*>(row.data() + 1), row.size() - 1);
+            return;
+        }
+        row[0] = 0; // Filter type None
+        beginChunk("IDAT");
+        if (rows == 1) {
+            chunk.push_back(0x78); // zlib header: deflate, 32K window
+            chunk.push_back(0x01);
+        }
+        for (size_t done = 0; done < row.size(); done += MAX_STORED_BLOCK) {
+            size_t size = min(MAX_STORED_BLOCK, row.size() - done);
+            storedBlock(row.data() + done, size, rows == height && done + size == row.size());
+        }
+        if (rows == height) {
+            be32(adler);
+        }
+        endChunk();
+    }
+    void finish() {
+        if (format == ImageFormat::Png) {
+            beginChunk("IEND");
+            endChunk();
+        }
+        out.flush();
+    }
+};
+
+// Streams the framebuffer as an image, each cell a scale x scale block in
+// its color on IMAGE_BACKGROUND. Returns false if the image would be too
+// large for either format.
+bool writeImage(const FrameBuffer& frame, int scale, ImageFormat format, ostream& out) {
+    long long width = static_cast<long long>(frame.getWidth()) * scale;
+    long long height = static_cast<long long>(frame.getHeight()) * scale;
+    if (width * 3 + 1 > INT32_MAX || height > INT32_MAX) {
+        return false;
+    }
+    ImageWriter writer(out, format, static_cast<uint32_t>(width), static_cast<uint32_t>(height));
+    vector<uint8_t> row(static_cast<size_t>(width) * 3 + 1);
+    for (int y = 0; y < frame.getHeight(); ++y) {
+        const Cell* cells = frame.row(y);
+        uint8_t* pixel = row.data() + 1;
+        for (int x = 0; x < frame.getWidth(); ++x) {
+            Rgb rgb = cells[x] == EMPTY_CELL ? IMAGE_BACKGROUND : palette().rgb(cells[x].color);
+            for (int i = 0; i < scale; ++i) {
+                *pixel++ = rgb.r;
+                *pixel++ = rgb.g;
+                *pixel++ = rgb.b;
+            }
+        }
+        for (int i = 0; i < scale; ++i) {
+            writer.writeRow(row);
+        }
+    }
+    writer.finish();
+    return true;
+}
+
+enum class ShapeKind : uint8_t {
+    Triangle,
+    Circle,
+    Square,
+    Rectangle,
+    Line
+};
+
+// Exact geometry of a shape, used to reject duplicates. For lines (x, y) is
+// the first end point and (a, b) the second; otherwise a and b are the
+// dimensions (unused ones stay 0).
+struct GeometryKey {
+    ShapeKind kind;
+    int x, y;
+    double a, b;
+
+    bool operator==(const GeometryKey& other) const {
+        return kind == other.kind && x == other.x && y == other.y && a == other.a && b == other.b;
+    }
+};
+
+struct GeometryKeyHash {
+    size_t operator()(const GeometryKey& key) const {
+        size_t h = std::hash<int>()(static_cast<int>(key.kind));
+        auto mix = [&h](size_t v) { h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2); };
+        mix(std::hash<int>()(key.x));
+        mix(std::hash<int>()(key.y));
+        mix(std::hash<double>()(key.a));
+        mix(std::hash<double>()(key.b));
+        return h;
+    }
+};
+
+const char* shapeName(ShapeKind kind) {
+    switch (kind) {
+    case ShapeKind::Triangle: return "triangle";
+    case ShapeKind::Circle: return "circle";
+    case ShapeKind::Square: return "square";
+    case ShapeKind::Rectangle: return "rectangle";
+    case ShapeKind::Line: return "Line";
+    }
+    return "shape";
+}
+
+// Counters for the hot paths, shown by the 'stats' command. Render threads
+// update them concurrently, so they are relaxed atomics. Building with
+// SHAPES_BLACKBOARD_NO_STATS removes every update along with the counters'
+// effect on RasterTarget.
+struct PerfCounters {
+    static const int KINDS = 5;
+
+    // drawOnBoard calls while rendering, per ShapeKind; the time is sampled
+    // (see DrawTally)
+    atomic<uint64_t> drawCalls[KINDS];
+    atomic<uint64_t> drawNanos[KINDS];
+    atomic<uint64_t> drawCells[KINDS];   // Cells written, overdraw included
+    atomic<uint64_t> renders;            // Board areas cleared and repainted
+    atomic<uint64_t> renderCells;
+    atomic<uint64_t> renderOccluded;     // Shapes skipped as hidden behind filled boxes
+    atomic<uint64_t> pointPicks;         // select x y
+    atomic<uint64_t> bufferPicks;        // ...answered from the shape-ID buffer
+    atomic<uint64_t> containsPointCalls;
+    atomic<uint64_t> occupancyChecks;    // isOccupied calls
+    atomic<uint64_t> occupancyCompared;  // Keys in the hash buckets looked at
+    atomic<uint64_t> loads, loadBytes, loadNanos;  // load and import
+    atomic<uint64_t> saves, saveBytes, saveNanos;  // save and export
+
+    PerfCounters() { reset(); }
+
+    void reset() {
+        for (int k = 0; k < KINDS; ++k) {
+            drawCalls[k] = 0;
+            drawNanos[k] = 0;
+            drawCells[k] = 0;
+        }
+        for (atomic<uint64_t>* counter : { &renders, &renderCells, &renderOccluded, &pointPicks, &bufferPicks, &containsPointCalls,
+                &occupancyChecks, &occupancyCompared, &loads, &loadBytes, &loadNanos, &saves, &saveBytes, &saveNanos }) {
+            *counter = 0;
+        }
+    }
+
+    void print(ostream& out) const {
+        static const char* const kinds[KINDS] = { "triangle", "circle", "square", "rectangle", "line" };
+        out << "Draw calls (times estimated from samples):\n";
+        for (int k = 0; k < KINDS; ++k) {
+            out << "  " << kinds[k] << ": " << drawCalls[k] << " calls, " << drawCells[k] << " cells, "
+                << drawNanos[k] / 1e6 << " ms\n";
+        }
+        out << "Renders: " << renders << " areas, " << renderCells << " cells, " << renderOccluded << " hidden shapes skipped\n";
+        out << "Point selects: " << pointPicks << " (" << bufferPicks << " from the shape-ID buffer), "
+            << containsPointCalls << " containsPoint calls\n";
+        out << "Occupancy checks: " << occupancyChecks << ", " << occupancyCompared << " keys compared\n";
+        out << "Loads: " << loads << ", " << loadBytes << " bytes, " << loadNanos / 1e6 << " ms\n";
+        out << "Saves: " << saves << ", " << saveBytes << " bytes, " << saveNanos / 1e6 << " ms\n";
+    }
+    void writeJson(ostream& out) const {
+        static const char* const kinds[KINDS] = { "triangle", "circle", "square", "rectangle", "line" };
+        out << "{\n  \"draw\": {";
+        for (int k = 0; k < KINDS; ++k) {
+            out << (k ? ",\n" : "\n") << "    \"" << kinds[k] << "\": {\"calls\": " << drawCalls[k]
+                << ", \"cells\": " << drawCells[k] << ", \"ns\": " << drawNanos[k] << "}";
+        }
+        out << "\n  },\n"
+            << "  \"render\": {\"areas\": " << renders << ", \"cells\": " << renderCells << ", \"occluded\": " << renderOccluded << "},\n"
+            << "  \"select\": {\"points\": " << pointPicks << ", \"buffer\": " << bufferPicks
+            << ", \"contains_point\": " << containsPointCalls << "},\n"
+            << "  \"occupancy\": {\"checks\": " << occupancyChecks << ", \"compared\": " << occupancyCompared << "},\n"
+            << "  \"load\": {\"count\": " << loads << ", \"bytes\": " << loadBytes << ", \"ns\": " << loadNanos << "},\n"
+            << "  \"save\": {\"count\": " << saves << ", \"bytes\": " << saveBytes << ", \"ns\": " << saveNanos << "}\n}\n";
+    }
+};
+
+PerfCounters& perfCounters() {
+    static PerfCounters instance;
+    return instance;
+}
+
+// Adds the time until the end of the scope to a nanosecond counter.
+class StatTimer {
+private:
+    atomic<uint64_t>& nanos;
+    chrono::steady_clock::time_point start;
+public:
+    explicit StatTimer(atomic<uint64_t>& counter) : nanos(counter), start(chrono::steady_clock::now()) {}
+    ~StatTimer() {
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+        nanos.fetch_add(static_cast<uint64_t>(elapsed.count()), memory_order_relaxed);
+    }
+};
+
+#if SHAPES_STATS
+// Draw counts for one render, added to the shared counters at the end.
+struct DrawTally {
+    // drawOnBoard is timed on every SAMPLE-th call of each kind and the time
+    // scaled up; reading the clock around every call would cost more than
+    // drawing most shapes.
+    static const uint64_t SAMPLE = 16;
+
+    uint64_t calls[PerfCounters::KINDS] = {};
+    uint64_t cells[PerfCounters::KINDS] = {};
+    uint64_t nanos[PerfCounters::KINDS] = {};
+
+    template <typename Draw>
+    void draw(int kind, const RasterTarget& target, Draw&& drawShape) {
+        uint64_t before = target.getWritten();
+        if (calls[kind]++ % SAMPLE == 0) {
+            auto start = chrono::steady_clock::now();
+            drawShape();
+            nanos[kind] += SAMPLE * chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        }
+        else {
+            drawShape();
+        }
+        cells[kind] += target.getWritten() - before;
+    }
+    void flush() const {
+        PerfCounters& counters = perfCounters();
+        for (int k = 0; k < PerfCounters::KINDS; ++k) {
+            if (calls[k] > 0) {
+                counters.drawCalls[k].fetch_add(calls[k], memory_order_relaxed);
+                counters.drawCells[k].fetch_add(cells[k], memory_order_relaxed);
+                counters.drawNanos[k].fetch_add(nanos[k], memory_order_relaxed);
+            }
+        }
+    }
+};
+
+#define STAT_ADD(counter, n) perfCounters().counter.fetch_add((n), memory_order_relaxed)
+#define STAT_TIMER(name, counter) StatTimer name(perfCounters().counter)
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_TIMER(name, counter) ((void)0)
+#endif
+
+// Shape geometry is plain data kept in per-type arrays by ShapeStore; the
+// shape's ID, color and fill mode live next to it in the store. Every type
+// has the same set of non-virtual members, so code templated on the type
+// (ShapeStore::visit and friends) works with any of them.
+struct Triangle {
+    static constexpr ShapeKind kind = ShapeKind::Triangle;
+    int x, y;
+    double height;
+
+    static Triangle fromKey(const GeometryKey& g) { return { g.x, g.y, g.a }; }
+    string getInfo(int id, const string& color, const string& fillMode) const {
+        return "Triangle: ID=" + to_string(id) +
+            " Height=" + to_string(height) +
+            " Color=" + color + " FillMode=" + fillMode + " at (" + to_string(x) + "," + to_string(y) + ")";
+    }
+    string getLoad(int id, const string& color, const string& fillMode) const {
+        return "Triangle: " + to_string(id) + " " + to_string(x) + " " + to_string(y) + " " + to_string(height) + " " + color + " " + fillMode;
+    }
+    GeometryKey getKey() const {
+        return { ShapeKind::Triangle, x, y, height, 0 };
+    }
+    Rect getBounds() const {
+        int heightInt = height;
+        return { x - heightInt + 1, y, x + heightInt, y + heightInt };
+    }
+    void moveTo(int newX, int newY) {
+        x = newX;
+        y = newY;
+    }
+    void drawOnBoard(RasterTarget& grid, Cell symbol, FillMode fillMode) const {
+        int heightInt = height;
+        bool filled = fillMode == FillMode::Fill;
+
+        // Row i spans [x - i, x + i]; the last row is the base
+        int first, last;
+        grid.clipRows(y, heightInt, first, last);
+        for (int i = first; i < last; ++i) {
+            int posY = y + i;
+            if (filled || i == heightInt - 1) {
+                grid.fillSpan(posY, x - i, x + i + 1, symbol);
+            }
+            else {
+                grid.set(x - i, posY, symbol); // Left border
+                grid.set(x + i, posY, symbol); // Right border
+            }
+        }
+    }
+    // False, leaving the shape unchanged, if it would not fit on the board
+    bool setDimensions(double h, double boardArea) {
+        if (0.5*h*(2 * h - 1 )< boardArea) {
+            height = h;
+            return true;
+        }
+        return false;
+    }
+};
+
+struct Circle {
+    static constexpr ShapeKind kind = ShapeKind::Circle;
+    int x, y;
+    double radius;
+
+    static Circle fromKey(const GeometryKey& g) { return { g.x, g.y, g.a }; }
+    string getInfo(int id, const string& color, const string& fillMode) const {
+        return "Circle: ID=" + to_string(id) + " Radius=" + to_string(radius) +
+            " Color=" + color + " FillMode=" + fillMode +
+            " at (" + to_string(x) + "," + to_string(y) + ")";
+    }
+    string getLoad(int id, const string& color, const string& fillMode) const {
+        return "Circle: " + to_string(id) + " " + to_string(x) + " " + to_string(y) + " " + to_string(radius) + " " + color + " " + fillMode;
+    }
+    GeometryKey getKey() const {
+        return { ShapeKind::Circle, x, y, radius, 0 };
+    }
+    Rect getBounds() const {
+        int r = static_cast<int>(radius);
+        return { x - r, y - r, x + r + 1, y + r + 1 };
+    }
+    void moveTo(int newX, int newY) {
+        x = newX;
+        y = newY;
+    }
+    void drawOnBoard(RasterTarget& grid, Cell coloredSymbol, FillMode fillMode) const {
+        bool filled = fillMode == FillMode::Fill;
+        if (!filled && fillMode != FillMode::Frame) {
+            return;
+        }
+        if (radius < 0) {
+            return;
+        }
+
+        int r = static_cast<int>(radius);
+        double outer = filled ? radius * radius : (radius + 0.5) * (radius + 0.5);
+        double inner = (radius - 0.5) * (radius - 0.5);
+
+        int first, last;
+        grid.clipRows(y - r, 2 * r + 1, first, last);
+        for (int row = first; row < last; ++row) {
+            int j = row - r;
+            double jj = static_cast<double>(j) * j;
+            // Widest offset still inside the outer radius, capped at r
+            int out = static_cast<int>(sqrt(max(0.0, outer - jj)));
+            out = min(out, r);
+            while (out >= 0 && out * out + jj > outer) --out;
+            while (out < r && (out + 1) * (out + 1) + jj <= outer) ++out;
+            if (out < 0) {
+                continue;
+            }
+
+            int posY = y + j;
+            if (filled) {
+                grid.fillSpan(posY, x - out, x + out + 1, coloredSymbol);
+                continue;
+            }
+            // Frame: offsets from the inner radius outwards, on both sides
+            int in = static_cast<int>(sqrt(max(0.0, inner - jj)));
+            while (in > 0 && (in - 1) * (in - 1) + jj >= inner) --in;
+            while (in <= out && in * in + jj < inner) ++in;
+            if (in > out) {
+                continue;
+            }
+            if (in == 0) {
+                grid.fillSpan(posY, x - out, x + out + 1, coloredSymbol);
+            }
+            else {
+                grid.fillSpan(posY, x - out, x - in + 1, coloredSymbol);
+                grid.fillSpan(posY, x + in, x + out + 1, coloredSymbol);
+            }
+        }
+    }
+
+    // False, leaving the shape unchanged, if it would not fit on the board
+    bool setDimensions(double r, double boardArea) {
+        if (PI * r * r < boardArea) {
+            radius = r;
+            return true;
+        }
+        return false;
+    }
+};
+struct Square {
+    static constexpr ShapeKind kind = ShapeKind::Square;
+    int x, y;
+    double side;
+
+    static Square fromKey(const GeometryKey& g) { return { g.x, g.y, g.a }; }
+    string getInfo(int id, const string& color, const string& fillMode) const {
+        return "Square: ID=" + to_string(id) + " Side=" + to_string(side) +
+            " Color=" + color + " FillMode=" + fillMode +
+            " at (" + to_string(x) + "," + to_string(y) + ")";
+    }
+
+    string getLoad(int id, const string& color, const string& fillMode) const {
+        return "Square: " + to_string(id) + " " + to_string(x) + " " + to_string(y) +
+            " " + to_string(side) + " " + color + " " + fillMode;
+    }
+    // False, leaving the shape unchanged, if it would not fit on the board
+    bool setDimensions(double s, double boardArea) {
+        if (s * s < boardArea) {
+            side = s;
+            return true;
+        }
+        return false;
+    }
+    GeometryKey getKey() const {
+        return { ShapeKind::Square, x, y, side, 0 };
+    }
+    Rect getBounds() const {
+        int sideInt = side;
+        return { x, y, x + sideInt, y + sideInt };
+    }
+    void moveTo(int newX, int newY) {
+        x = newX;
+        y = newY;
+    }
+    void drawOnBoard(RasterTarget& grid, Cell symbol, FillMode fillMode) const {
+        int sideInt = side;
+        bool filled = fillMode == FillMode::Fill;
+
+        int first, last;
+        grid.clipRows(y, sideInt, first, last);
+        for (int i = first; i < last; ++i) {
+            int posY = y + i;
+            if (filled || i == 0 || i == sideInt - 1) {
+                grid.fillSpan(posY, x, x + sideInt, symbol);
+            }
+            else {
+                grid.set(x, posY, symbol);               // Left border
+                grid.set(x + sideInt - 1, posY, symbol); // Right border
+            }
+        }
+    }
+
+};
+struct Rectangle {
+    static constexpr ShapeKind kind = ShapeKind::Rectangle;
     int x, y;
-    string shape;
-    string color;
-    string fillMode;
+    double  width, height;
+
+    static Rectangle fromKey(const GeometryKey& g) { return { g.x, g.y, g.a, g.b }; }
+    string getInfo(int, const string& color, const string& fillMode) const {
+        return "Rectangle: top-left corner (" + std::to_string(x) + ", " + std::to_string(y) +
+            "), width " + std::to_string(width) + ", height " + std::to_string(height) + " Color=" + color + " FillMode=" + fillMode;
+    }
+    string getLoad(int id, const string& color, const string& fillMode) const {
+        return "Rectangle: " + to_string(id) + " " + to_string(x) + " " + to_string(y) + " " + to_string(width) + " " + to_string(height) + " " + color + " " + fillMode;
+    }
+    GeometryKey getKey() const {
+        return { ShapeKind::Rectangle, x, y, width, height };
+    }
+    Rect getBounds() const {
+        int heightInt = height;
+        int widthInt = width;
+        return { x, y, x + widthInt, y + heightInt };
+    }
+    void moveTo(int newX, int newY) {
+        x = newX;
+        y = newY;
+    }
+    void drawOnBoard(RasterTarget& grid, Cell symbol, FillMode fillMode) const {
+        int heightInt = height;
+        int widthInt = width;
+        bool filled = fillMode == FillMode::Fill;
+        if (widthInt <= 0) {
+            return;
+        }
+
+        int first, last;
+        grid.clipRows(y, heightInt, first, last);
+        for (int i = first; i < last; ++i) {
+            int posY = y + i;
+            if (filled || i == 0 || i == heightInt - 1) {
+                grid.fillSpan(posY, x, x + widthInt, symbol);
+            }
+            else {
+                grid.set(x, posY, symbol);                // Left side
+                grid.set(x + widthInt - 1, posY, symbol); // Right side
+            }
+        }
+    }
+
+    // False, leaving the shape unchanged, if it would not fit on the board
+    bool setDimensions(double w, double h, double boardArea) {
+        if (w * h < boardArea) {
+            width = w;
+            height = h;
+            return true;
+        }
+        return false;
+    }
+};
+
+struct Line {
+    static constexpr ShapeKind kind = ShapeKind::Line;
+    int x1, y1, x2, y2;
+
+    static Line fromKey(const GeometryKey& g) { return { g.x, g.y, static_cast<int>(g.a), static_cast<int>(g.b) }; }
+    void setDimensions(int x, int y, int z, int t) {
+        x1 = x;
+        y1 = y;
+        x2 = z;
+        y2 = t;
+    }
+    GeometryKey getKey() const {
+        return { ShapeKind::Line, x1, y1, static_cast<double>(x2), static_cast<double>(y2) };
+    }
+    Rect getBounds() const {
+        return { min(x1, x2), min(y1, y2), max(x1, x2) + 1, max(y1, y2) + 1 };
+    }
+    // Moves the first end point to (newX, newY), keeping the line's direction
+    void moveTo(int newX, int newY) {
+        x2 += newX - x1;
+        y2 += newY - y1;
+        x1 = newX;
+        y1 = newY;
+    }
+    void drawOnBoard(RasterTarget& grid, Cell symbol, FillMode) const {
+        int dx = abs(x2 - x1);
+        int dy = abs(y2 - y1);
+        int sx = (x1 < x2) ? 1 : -1;
+        int sy = (y1 < y2) ? 1 : -1;
+        int err = dx - dy;
+
+        int x = x1;
+        int y = y1;
+
+        while (true) {
+            grid.set(x, y, symbol);
+
+            if (x == x2 && y == y2) break;
+
+            int e2 = err;
+
+            if (e2 > -dy) {
+                err -= dy;
+                x += sx;
+            }
+
+            if (e2 < dx) {
+                err += dx;
+                y += sy;
+            }
+        }
+    }
+
+
+    string getInfo(int, const string& color, const string& fillMode) const {
+        return "Line: from (" + std::to_string(x1) + ", " + std::to_string(y1) + ") to (" +
+            std::to_string(x2) + ", " + std::to_string(y2) + ")" +
+            " Color=" + color + " FillMode=" + fillMode;
+    }
+    string getLoad(int id, const string& color, const string& fillMode) const {
+        return "Line: " + std::to_string(id) + " " + std::to_string(x1) + " " +
+            std::to_string(y1) + " " + std::to_string(x2) + " " + std::to_string(y2) + " " + color + " " + fillMode;
+    }
+};
+
+// Array kept in fixed-size chunks that copies share until one of them
+// writes: copying the array copies the chunk pointers, and a write copies
+// at most the one chunk it lands in. Only one thread may write; others
+// may read copies taken earlier.
+template <typename T>
+class ChunkedArray {
+private:
+    static const size_t CHUNK = 256;
+    struct Chunk {
+        T items[CHUNK];
+    };
+    vector<shared_ptr<Chunk>> chunks;
+    size_t count;
 public:
-    Shapes(string s, int id, int x, int y, string color, string fillMode)
-        : shape(s), id(id), x(x), y(y), color(color), fillMode(fillMode) {}    
-    virtual string getInfo() const = 0;
-    virtual string getShape() const { return shape; }
-    int getID() const { return id; }
-    int getX() const { return x; }
-    int getY() const { return y; }
-    void setX(int newX) {
-        x = newX; 
-    }
-    void setY(int newY) {
-        y = newY; 
-    }
-    string getColor() const { return color; }
-    string getFillMode() const { return fillMode; }
-    virtual void drawOnBoard(vector<vector<string>>& grid) const = 0;
-    virtual string getLoad() const = 0;
-    virtual ~Shapes() {}
-    virtual bool containsPoint(int x, int y) const = 0;
-    virtual void setColor(const std::string& newColor) {
-        color = newColor;
-    }
-    static std::string getColorCode(const std::string& colorName) {
-        std::unordered_map<std::string, std::string> colorCodes = {
-            {"black", "0"},
-            {"red", "1"},
-            {"green", "2"},
-            {"yellow", "3"},
-            {"blue", "4"},
-            {"magenta", "5"},
-            {"cyan", "6"},
-            {"white", "7"}
-        };
+    ChunkedArray() : count(0) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T& operator[](size_t i) const { return chunks[i / CHUNK]->items[i % CHUNK]; }
+    const T& back() const { return (*this)[count - 1]; }
+    T& write(size_t i) {
+        shared_ptr<Chunk>& chunk = chunks[i / CHUNK];
+        if (chunk.use_count() > 1) {
+            chunk = make_shared<Chunk>(*chunk);
+        }
+        else {
+            // Pairs with the release in the last other owner's reference drop
+            atomic_thread_fence(memory_order_acquire);
+        }
+        return chunk->items[i % CHUNK];
+    }
+    void push_back(const T& value) {
+        if (count == chunks.size() * CHUNK) {
+            chunks.push_back(make_shared<Chunk>());
+        }
+        write(count++) = value;
+    }
+    void pop_back() {
+        if (--count % CHUNK == 0) {
+            chunks.pop_back();
+        }
+    }
+    void resize(size_t size, const T& value) {
+        while (count < size) push_back(value);
+        while (count > size) pop_back();
+    }
+    void clear() {
+        chunks.clear();
+        count = 0;
+    }
+};
+
+// All shapes of one type: geometry, style and cached bounding box in
+// parallel arrays, plus the ID of each entry so the store can fix its slot
+// table after a removal.
+template <typename Geometry>
+struct ShapeColumn {
+    ChunkedArray<int32_t> ids;
+    ChunkedArray<Geometry> geometry;
+    ChunkedArray<ShapeStyle> styles;
+    ChunkedArray<Rect> bounds;
+
+    size_t size() const { return ids.size(); }
+    uint32_t push(int32_t id, const Geometry& g, ShapeStyle style) {
+        ids.push_back(id);
+        geometry.push_back(g);
+        styles.push_back(style);
+        bounds.push_back(g.getBounds());
+        return static_cast<uint32_t>(ids.size() - 1);
+    }
+    // Fills the hole with the last entry; returns the ID of the entry that
+    // moved into it, or NO_SHAPE if the removed entry was the last one.
+    int32_t swapRemove(uint32_t index) {
+        uint32_t last = static_cast<uint32_t>(ids.size() - 1);
+        int32_t moved = NO_SHAPE;
+        if (index != last) {
+            ids.write(index) = ids[last];
+            geometry.write(index) = geometry[last];
+            styles.write(index) = styles[last];
+            bounds.write(index) = bounds[last];
+            moved = ids[index];
+        }
+        ids.pop_back();
+        geometry.pop_back();
+        styles.pop_back();
+        bounds.pop_back();
+        return moved;
+    }
+    void clear() {
+        ids.clear();
+        geometry.clear();
+        styles.clear();
+        bounds.clear();
+    }
+};
+
+// Structure-of-arrays shape store. Each shape type has its own column, and
+// a dense table indexed by shape ID gives each live shape's type and row.
+// IDs never change, and walking the table in ID order gives the z-order.
+// The table and columns are chunked copy-on-write arrays: copying the store
+// for a snapshot is cheap, and each later change copies one chunk at most.
+class ShapeStore {
+private:
+    struct Slot {
+        ShapeKind kind;
+        bool live;
+        uint32_t index;  // Row in the column for kind
+    };
+    ChunkedArray<Slot> slots;  // Indexed by shape ID; dead entries at the end are trimmed
+    size_t count;
+    ShapeColumn<Triangle> triangles;
+    ShapeColumn<Circle> circles;
+    ShapeColumn<Square> squares;
+    ShapeColumn<Rectangle> rectangles;
+    ShapeColumn<Line> lines;
+
+    template <typename Geometry>
+    ShapeColumn<Geometry>& column() {
+        return const_cast<ShapeColumn<Geometry>&>(static_cast<const ShapeStore*>(this)->column<Geometry>());
+    }
+    template <typename Geometry>
+    const ShapeColumn<Geometry>& column() const {
+        if constexpr (std::is_same_v<Geometry, Triangle>) return triangles;
+        else if constexpr (std::is_same_v<Geometry, Circle>) return circles;
+        else if constexpr (std::is_same_v<Geometry, Square>) return squares;
+        else if constexpr (std::is_same_v<Geometry, Rectangle>) return rectangles;
+        else return lines;
+    }
+    template <typename Geometry>
+    void removeFrom(uint32_t index) {
+        int32_t moved = column<Geometry>().swapRemove(index);
+        if (moved != NO_SHAPE) {
+            slots.write(moved).index = index;
+        }
+    }
+public:
+    ShapeStore() : count(0) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool contains(int id) const {
+        return id >= 0 && id < static_cast<int>(slots.size()) && slots[id].live;
+    }
+    ShapeKind kindOf(int id) const { return slots[id].kind; }
+    // Highest live ID (the top of the z-order), or NO_SHAPE
+    int lastId() const {
+        return slots.empty() ? NO_SHAPE : static_cast<int>(slots.size()) - 1;
+    }
+
+    template <typename Geometry>
+    void add(int id, const Geometry& g, ShapeStyle style) {
+        if (contains(id)) {
+            remove(id);
+        }
+        if (id >= static_cast<int>(slots.size())) {
+            slots.resize(id + 1, Slot{ ShapeKind::Triangle, false, 0 });
+        }
+        slots.write(id) = { Geometry::kind, true, column<Geometry>().push(id, g, style) };
+        ++count;
+    }
+    void add(int id, const GeometryKey& g, ShapeStyle style) {
+        switch (g.kind) {
+        case ShapeKind::Triangle: add(id, Triangle::fromKey(g), style); break;
+        case ShapeKind::Circle: add(id, Circle::fromKey(g), style); break;
+        case ShapeKind::Square: add(id, Square::fromKey(g), style); break;
+        case ShapeKind::Rectangle: add(id, Rectangle::fromKey(g), style); break;
+        case ShapeKind::Line: add(id, Line::fromKey(g), style); break;
+        }
+    }
+    void remove(int id) {
+        Slot& slot = slots.write(id);
+        switch (slot.kind) {
+        case ShapeKind::Triangle: removeFrom<Triangle>(slot.index); break;
+        case ShapeKind::Circle: removeFrom<Circle>(slot.index); break;
+        case ShapeKind::Square: removeFrom<Square>(slot.index); break;
+        case ShapeKind::Rectangle: removeFrom<Rectangle>(slot.index); break;
+        case ShapeKind::Line: removeFrom<Line>(slot.index); break;
+        }
+        slot.live = false;
+        --count;
+        while (!slots.empty() && !slots.back().live) {
+            slots.pop_back();
+        }
+    }
+    void clear() {
+        slots.clear();
+        count = 0;
+        triangles.clear();
+        circles.clear();
+        squares.clear();
+        rectangles.clear();
+        lines.clear();
+    }
+
+    // Geometry to change in place; call updateBounds(id) when done.
+    template <typename Geometry>
+    Geometry& get(int id) { return column<Geometry>().geometry.write(slots[id].index); }
+    Rect updateBounds(int id) {
+        const Slot& slot = slots[id];
+        auto update = [&slot](auto& column) { return column.bounds.write(slot.index) = column.geometry[slot.index].getBounds(); };
+        switch (slot.kind) {
+        case ShapeKind::Triangle: return update(triangles);
+        case ShapeKind::Circle: return update(circles);
+        case ShapeKind::Square: return update(squares);
+        case ShapeKind::Rectangle: return update(rectangles);
+        default: return update(lines);
+        }
+    }
+    void setColor(int id, ColorId colorId) {
+        const Slot& slot = slots[id];
+        switch (slot.kind) {
+        case ShapeKind::Triangle: triangles.styles.write(slot.index).color = colorId; break;
+        case ShapeKind::Circle: circles.styles.write(slot.index).color = colorId; break;
+        case ShapeKind::Square: squares.styles.write(slot.index).color = colorId; break;
+        case ShapeKind::Rectangle: rectangles.styles.write(slot.index).color = colorId; break;
+        case ShapeKind::Line: lines.styles.write(slot.index).color = colorId; break;
+        }
+    }
+
+    const string& colorName(ShapeStyle style) const { return palette().colorName(style.color); }
+    const string& fillName(ShapeStyle style) const { return palette().fillName(style.fill); }
+    FillMode fillMode(ShapeStyle style) const { return palette().fillMode(style.fill); }
+    Cell symbol(ShapeStyle style) const { return palette().symbol(style.color); }
+
+    // Calls fn(geometry, style) with the concrete geometry of a live shape.
+    template <typename Fn>
+    decltype(auto) visit(int id, Fn&& fn) const {
+        const Slot& slot = slots[id];
+        switch (slot.kind) {
+        case ShapeKind::Triangle: return fn(triangles.geometry[slot.index], triangles.styles[slot.index]);
+        case ShapeKind::Circle: return fn(circles.geometry[slot.index], circles.styles[slot.index]);
+        case ShapeKind::Square: return fn(squares.geometry[slot.index], squares.styles[slot.index]);
+        case ShapeKind::Rectangle: return fn(rectangles.geometry[slot.index], rectangles.styles[slot.index]);
+        default: return fn(lines.geometry[slot.index], lines.styles[slot.index]);
+        }
+    }
+    // Calls fn(id, geometry, style) for every shape in z-order.
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        for (int id = 0; id < static_cast<int>(slots.size()); ++id) {
+            if (slots[id].live) {
+                visit(id, [&](const auto& g, ShapeStyle style) { fn(id, g, style); });
+            }
+        }
+    }
+    // Calls fn(column) once per shape type, in ShapeKind order.
+    template <typename Fn>
+    void forEachColumn(Fn&& fn) const {
+        fn(triangles);
+        fn(circles);
+        fn(squares);
+        fn(rectangles);
+        fn(lines);
+    }
+
+    ShapeStyle style(int id) const {
+        return visit(id, [](const auto&, ShapeStyle style) { return style; });
+    }
+    Rect bounds(int id) const {
+        const Slot& slot = slots[id];
+        switch (slot.kind) {
+        case ShapeKind::Triangle: return triangles.bounds[slot.index];
+        case ShapeKind::Circle: return circles.bounds[slot.index];
+        case ShapeKind::Square: return squares.bounds[slot.index];
+        case ShapeKind::Rectangle: return rectangles.bounds[slot.index];
+        default: return lines.bounds[slot.index];
+        }
+    }
+    // True if drawing the shape paints every cell of its bounds: filled
+    // squares and rectangles.
+    bool fillsBounds(int id) const {
+        const Slot& slot = slots[id];
+        if (slot.kind == ShapeKind::Square) {
+            return fillMode(squares.styles[slot.index]) == FillMode::Fill;
+        }
+        return slot.kind == ShapeKind::Rectangle && fillMode(rectangles.styles[slot.index]) == FillMode::Fill;
+    }
+    GeometryKey key(int id) const {
+        return visit(id, [](const auto& g, ShapeStyle) { return g.getKey(); });
+    }
+    string info(int id) const {
+        return visit(id, [&](const auto& g, ShapeStyle style) { return g.getInfo(id, colorName(style), fillName(style)); });
+    }
+    // True if drawing the shape would cover cell (px, py): the shape is
+    // rasterized into a probe clipped to that one cell, so picking matches
+    // the drawing.
+    bool containsPoint(int id, int px, int py) const {
+        STAT_ADD(containsPointCalls, 1);
+        return visit(id, [&](const auto& g, ShapeStyle style) {
+            RasterTarget probe = RasterTarget::probe(px, py);
+            g.drawOnBoard(probe, symbol(style), fillMode(style));
+            return probe.wasHit();
+        });
+    }
+};
+
+// Binary board snapshot, all values little-endian:
+//   header   "SHBB", u16 version, u16 reserved, i32 nextID,
+//            i32 board width, i32 board height (version 2+), u32 string count
+//   strings  u32 length + bytes each (colors and fill modes)
+//   sections u32 section count, then per section u8 kind, u32 record count
+//            and fixed-size records of that kind (see recordSize)
+const char SNAPSHOT_MAGIC[4] = { 'S', 'H', 'B', 'B' };
+const uint16_t SNAPSHOT_VERSION = 2;
+
+class ByteWriter {
+private:
+    vector<char>& out;
+public:
+    explicit ByteWriter(vector<char>& buffer) : out(buffer) {}
+    void u8(uint8_t v) { out.push_back(static_cast<char>(v)); }
+    void u16(uint16_t v) {
+        u8(v & 0xFF);
+        u8(v >> 8);
+    }
+    void u32(uint32_t v) {
+        u16(v & 0xFFFF);
+        u16(v >> 16);
+    }
+    void i32(int32_t v) { u32(static_cast<uint32_t>(v)); }
+    void f64(double v) {
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        u32(static_cast<uint32_t>(bits));
+        u32(static_cast<uint32_t>(bits >> 32));
+    }
+    void bytes(const char* data, size_t size) { out.insert(out.end(), data, data + size); }
+};
+
+// Bounds-checked reader; once a read runs past the end, ok() stays false.
+class ByteReader {
+private:
+    const char* data;
+    size_t size;
+    size_t pos;
+    bool good;
+
+    bool need(size_t n) {
+        if (!good || size - pos < n) {
+            good = false;
+            return false;
+        }
+        return true;
+    }
+public:
+    ByteReader(const char* d, size_t n) : data(d), size(n), pos(0), good(true) {}
+    bool ok() const { return good; }
+    size_t remaining() const { return size - pos; }
+    uint8_t u8() {
+        if (!need(1)) return 0;
+        return static_cast<uint8_t>(data[pos++]);
+    }
+    uint16_t u16() {
+        uint16_t lo = u8();
+        return static_cast<uint16_t>(lo | (u8() << 8));
+    }
+    uint32_t u32() {
+        uint32_t lo = u16();
+        return lo | (static_cast<uint32_t>(u16()) << 16);
+    }
+    int32_t i32() { return static_cast<int32_t>(u32()); }
+    double f64() {
+        uint64_t lo = u32();
+        uint64_t bits = lo | (static_cast<uint64_t>(u32()) << 32);
+        double v;
+        memcpy(&v, &bits, sizeof(v));
+        return v;
+    }
+    const char* bytes(size_t n) {
+        if (!need(n)) return nullptr;
+        const char* p = data + pos;
+        pos += n;
+        return p;
+    }
+};
+
+// Read-only memory mapping of a whole file. An empty file maps to size 0.
+class MappedFile {
+private:
+    const char* bytes;
+    size_t length;
+    bool opened;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+public:
+    explicit MappedFile(const string& path) : bytes(nullptr), length(0), opened(false) {
+#ifdef _WIN32
+        mapping = nullptr;
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize)) {
+            return;
+        }
+        length = static_cast<size_t>(fileSize.QuadPart);
+        if (length == 0) {
+            opened = true;
+            return;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) {
+            bytes = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        }
+#else
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            return;
+        }
+        length = static_cast<size_t>(info.st_size);
+        if (length == 0) {
+            opened = true;
+            return;
+        }
+        void* view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED) {
+            bytes = static_cast<const char*>(view);
+            madvise(view, length, MADV_SEQUENTIAL);
+        }
+#endif
+        opened = bytes != nullptr;
+    }
+    ~MappedFile() {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (bytes) munmap(const_cast<char*>(bytes), length);
+        if (fd >= 0) close(fd);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return opened; }
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Splits a line of text into whitespace-separated tokens without copying.
+class TokenCursor {
+private:
+    std::string_view rest;
 
-        if (colorCodes.find(colorName) != colorCodes.end()) {
-            return "\033[3" + colorCodes[colorName] + "m"; // Text color only
+    template <typename T>
+    bool nextNumber(T& value) {
+        std::string_view token;
+        if (!next(token)) return false;
+        auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+        return result.ec == std::errc() && result.ptr == token.data() + token.size();
+    }
+public:
+    explicit TokenCursor(std::string_view text) : rest(text) {}
+    bool next(std::string_view& token) {
+        size_t start = rest.find_first_not_of(" \t\r");
+        if (start == std::string_view::npos) {
+            rest = {};
+            return false;
         }
-        else {
-            return ""; // Return empty string if the color is not found
+        size_t end = rest.find_first_of(" \t\r", start);
+        if (end == std::string_view::npos) {
+            end = rest.size();
         }
+        token = rest.substr(start, end - start);
+        rest.remove_prefix(end);
+        return true;
     }
+    bool nextInt(int& value) { return nextNumber(value); }
+    bool nextDouble(double& value) { return nextNumber(value); }
 };
 
-class Triangle : public Shapes {
+// Uniform grid over shape bounding boxes. Each bucket keeps its shape IDs
+// sorted, so walking a bucket backwards visits shapes top-most first.
+// Shapes spanning too many buckets are kept in a separate "oversized" list.
+// Like ShapeStore, the index is chunked and copy-on-write: buckets come in
+// shared blocks of BLOCK_SIZE x BLOCK_SIZE and bounds in a ChunkedArray,
+// so a copy shares them all and each side copies a block when it writes.
+class SpatialIndex {
 private:
-    double  height;
+    static const int CELL_SIZE = 16;
+    static const int BLOCK_SIZE = 16;  // Buckets per block side
+    static const long long MAX_BUCKETS_PER_SHAPE = 4096;
+
+    struct Block {
+        vector<int> buckets[BLOCK_SIZE * BLOCK_SIZE];
+        size_t count;  // IDs in all buckets; empty blocks are dropped
+
+        Block() : count(0) {}
+    };
+    unordered_map<long long, shared_ptr<Block>> blocks;
+    ChunkedArray<Rect> entries;  // Indexed by shape ID; empty if not indexed
+    shared_ptr<vector<int>> oversized;
+
+    // Rounds towards negative infinity
+    static int floorDiv(int v, int d) {
+        return v >= 0 ? v / d : -((-v + d - 1) / d);
+    }
+    static int cellOf(int v) { return floorDiv(v, CELL_SIZE); }
+    // Built from unsigned halves; shifting a negative x would be undefined
+    static long long keyOf(int x, int y) {
+        return static_cast<long long>((static_cast<unsigned long long>(static_cast<unsigned int>(x)) << 32) | static_cast<unsigned int>(y));
+    }
+    static long long blockOf(int cx, int cy) {
+        return keyOf(floorDiv(cx, BLOCK_SIZE), floorDiv(cy, BLOCK_SIZE));
+    }
+    static int slotOf(int cx, int cy) {
+        return (cy - floorDiv(cy, BLOCK_SIZE) * BLOCK_SIZE) * BLOCK_SIZE + (cx - floorDiv(cx, BLOCK_SIZE) * BLOCK_SIZE);
+    }
+    static bool isOversized(const Rect& r) {
+        long long cols = static_cast<long long>(cellOf(r.right - 1)) - cellOf(r.left) + 1;
+        long long rows = static_cast<long long>(cellOf(r.bottom - 1)) - cellOf(r.top) + 1;
+        return cols * rows > MAX_BUCKETS_PER_SHAPE;
+    }
+    static void insertSorted(vector<int>& ids, int id) {
+        ids.insert(lower_bound(ids.begin(), ids.end(), id), id);
+    }
+    static bool eraseSorted(vector<int>& ids, int id) {
+        auto it = lower_bound(ids.begin(), ids.end(), id);
+        if (it != ids.end() && *it == id) {
+            ids.erase(it);
+            return true;
+        }
+        return false;
+    }
+    // Makes a shared pointer's target private to this index before a write.
+    template <typename T>
+    static T& unshare(shared_ptr<T>& p) {
+        if (!p) {
+            p = make_shared<T>();
+        }
+        else if (p.use_count() > 1) {
+            p = make_shared<T>(*p);
+        }
+        else {
+            atomic_thread_fence(memory_order_acquire); // As in ChunkedArray::write
+        }
+        return *p;
+    }
+    const vector<int>* findBucket(int cx, int cy) const {
+        auto block = blocks.find(blockOf(cx, cy));
+        return block != blocks.end() ? &block->second->buckets[slotOf(cx, cy)] : nullptr;
+    }
+    template <typename Fn>
+    static void forEachBucket(const Rect& r, Fn fn) {
+        for (int cy = cellOf(r.top); cy <= cellOf(r.bottom - 1); ++cy) {
+            for (int cx = cellOf(r.left); cx <= cellOf(r.right - 1); ++cx) {
+                fn(cx, cy);
+            }
+        }
+    }
 public:
-    Triangle(int id, int x, int y, double h, string color, string fillMode)
-        : Shapes("Triangle", id, x, y, color, fillMode), height(h) {}
-    bool containsPoint(int px, int py) const override {
-        // Calculate the vertices of the triangle
-        int x1 = x;        
-        int y1 = y;        
-        int x2 = x - (height / 2); 
-        int y2 = y + height;       
-        int x3 = x + (height / 2); 
-        int y3 = y + height;       
-
-        // Area of the triangle ABC
-        double areaABC = abs((x1 * (y2 - y3) + x2 * (y3 - y1) + x3 * (y1 - y2)) / 2.0);
-
-        // Area of triangle PAB
-        double areaPAB = abs((px * (y1 - y2) + x1 * (y2 - py) + x2 * (py - y1)) / 2.0);
-        // Area of triangle PBC
-        double areaPBC = abs((px * (y2 - y3) + x2 * (y3 - py) + x3 * (py - y2)) / 2.0);
-        // Area of triangle PCA
-        double areaPCA = abs((px * (y3 - y1) + x3 * (y1 - py) + x1 * (py - y3)) / 2.0);
-
-        // Check if the sum of PAB, PBC, and PCA is equal to ABC
-        return (areaPAB + areaPBC + areaPCA == areaABC);
-    }
-    string getShape() const override {
-        return "triangle";
-    }
-    string getInfo() const override {
-        return "Triangle: ID=" + to_string(id) +
-            " Height=" + to_string(height) +
-            " Color=" + color + " FillMode=" + fillMode + " at (" + to_string(x) + "," + to_string(y) + ")";
+    void insert(int id, const Rect& bounds) {
+        remove(id);
+        if (bounds.empty()) {
+            return;
+        }
+        if (id >= static_cast<int>(entries.size())) {
+            entries.resize(id + 1, Rect{ 0, 0, 0, 0 });
+        }
+        entries.write(id) = bounds;
+        if (isOversized(bounds)) {
+            insertSorted(unshare(oversized), id);
+            return;
+        }
+        forEachBucket(bounds, [&](int cx, int cy) {
+            Block& block = unshare(blocks[blockOf(cx, cy)]);
+            insertSorted(block.buckets[slotOf(cx, cy)], id);
+            ++block.count;
+        });
     }
-    string getLoad() const override {
-        return "Triangle: " + to_string(id) + " " + to_string(x) + " " + to_string(y) + " " + to_string(height) + " " + color + " " + fillMode;
+    void remove(int id) {
+        if (id >= static_cast<int>(entries.size()) || entries[id].empty()) {
+            return;
+        }
+        const Rect bounds = entries[id];
+        entries.write(id) = Rect{ 0, 0, 0, 0 };
+        if (isOversized(bounds)) {
+            eraseSorted(unshare(oversized), id);
+            return;
+        }
+        forEachBucket(bounds, [&](int cx, int cy) {
+            auto it = blocks.find(blockOf(cx, cy));
+            if (it == blocks.end()) {
+                return;
+            }
+            Block& block = unshare(it->second);
+            if (eraseSorted(block.buckets[slotOf(cx, cy)], id) && --block.count == 0) {
+                blocks.erase(it);
+            }
+        });
     }
-    void drawOnBoard(vector<vector<string>>& grid) const override {
-        int startX = x;
-        int startY = y;
-        int heightInt = height;
-        char symbolB = color.empty() ? '*' : color[0]; // Default symbol
-        std::string colorCode = getColorCode(color); // Get the ANSI color code for the shape's color
-        std::string resetCode = "\033[0m"; // ANSI code to reset color
-        string symbol = colorCode + std::string(1, symbolB) + resetCode;
-        // Apply the color code, draw the shape, and then reset color
-        
-        for (int i = 0; i < heightInt; ++i) {
-            int leftMost = startX - i;
-            int rightMost = startX + i;
-            int posY = startY + i;
-
-            if (posY < BOARD_HEIGHT) {
-                if (fillMode == "fill") {
-                    // Fill between leftMost and rightMost
-                    for (int j = leftMost; j <= rightMost; ++j) {
-                        if (j >= 0 && j < BOARD_WIDTH) {
-                            grid[posY][j]=symbol; // Set the symbol
-                        }
+    void clear() {
+        blocks.clear();
+        entries.clear();
+        oversized.reset();
+    }
+
+    // Calls fn(id) for every shape whose bounds contain (x, y), top-most
+    // first, until fn returns true.
+    template <typename Fn>
+    void visitPoint(int x, int y, Fn fn) const {
+        static const vector<int> none;
+        const vector<int>* bucket = findBucket(cellOf(x), cellOf(y));
+        const vector<int>& local = bucket ? *bucket : none;
+        const vector<int>& large = oversized ? *oversized : none;
+
+        auto a = local.rbegin();
+        auto b = large.rbegin();
+        while (a != local.rend() || b != large.rend()) {
+            int id;
+            if (b == large.rend() || (a != local.rend() && *a > *b)) {
+                id = *a++;
+            }
+            else {
+                id = *b++;
+            }
+            if (entries[id].contains(x, y) && fn(id)) {
+                return;
+            }
+        }
+    }
+
+    // IDs of all shapes whose bounds intersect the area, in ascending (z) order.
+    vector<int> query(const Rect& area) const {
+        vector<int> ids;
+        if (area.empty()) {
+            return ids;
+        }
+        forEachBucket(area, [&](int cx, int cy) {
+            if (const vector<int>* bucket = findBucket(cx, cy)) {
+                for (int id : *bucket) {
+                    if (entries[id].intersects(area)) {
+                        ids.push_back(id);
                     }
                 }
-
-                // Set leftmost border
-                if (leftMost >= 0 && leftMost < BOARD_WIDTH) {
-                    grid[posY][leftMost]=symbol; // Set the symbol for left border
+            }
+        });
+        if (oversized) {
+            for (int id : *oversized) {
+                if (entries[id].intersects(area)) {
+                    ids.push_back(id);
                 }
+            }
+        }
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        return ids;
+    }
+};
+
+// Everything an autosave writes, taken without copying the shapes: the
+// store and index share their chunks with the board until one side changes
+// them. Names are read from the palette, whose entries never move.
+struct BoardSnapshot {
+    ShapeStore shapes;
+    SpatialIndex index;  // Shared the same way as the shapes
+    int nextID;
+    int width;
+    int height;
+    uint64_t changes;  // Board::changeCount() when taken
+};
 
-                // Set rightmost border
-                if (rightMost >= 0 && rightMost < BOARD_WIDTH && leftMost != rightMost) {
-                    grid[posY][rightMost]=symbol; // Set the symbol for right border
+// Encodes a snapshot in the save format described above SNAPSHOT_MAGIC.
+void encodeSnapshot(const BoardSnapshot& snapshot, vector<char>& buffer) {
+    // Number the colors and fill modes in use, then emit one section per
+    // shape kind. Fill handles are offset so both share one lookup table.
+    vector<const string*> strings;
+    unordered_map<uint32_t, uint32_t> stringIds;
+    auto intern = [&](uint32_t handle, const string& value) {
+        auto it = stringIds.find(handle);
+        if (it != stringIds.end()) {
+            return it->second;
+        }
+        uint32_t id = static_cast<uint32_t>(strings.size());
+        strings.push_back(&value);
+        stringIds.emplace(handle, id);
+        return id;
+    };
+
+    // Each column already holds exactly one section's records
+    const int KIND_COUNT = 5;
+    vector<char> records[KIND_COUNT];
+    uint32_t counts[KIND_COUNT] = {};
+    snapshot.shapes.forEachColumn([&](const auto& column) {
+        for (size_t i = 0; i < column.size(); ++i) {
+            GeometryKey g = column.geometry[i].getKey();
+            int k = static_cast<int>(g.kind);
+            ByteWriter w(records[k]);
+            w.i32(column.ids[i]);
+            w.i32(g.x);
+            w.i32(g.y);
+            if (g.kind == ShapeKind::Line) {
+                w.i32(static_cast<int32_t>(g.a));
+                w.i32(static_cast<int32_t>(g.b));
+            }
+            else {
+                w.f64(g.a);
+                if (g.kind == ShapeKind::Rectangle) {
+                    w.f64(g.b);
                 }
             }
+            ShapeStyle style = column.styles[i];
+            w.u32(intern(style.color, palette().colorName(style.color)));
+            w.u32(intern(0x10000u + style.fill, palette().fillName(style.fill)));
+            ++counts[k];
         }
+    });
 
-        // Draw the base of the triangle
-        for (int j = 0; j < 2 * heightInt - 1; ++j) {
-            int baseX = x - heightInt + 1 + j;
-            int baseY = y + heightInt - 1;
-            if (baseX >= 0 && baseX < BOARD_WIDTH && baseY < BOARD_HEIGHT) {
-                grid[baseY][baseX] = symbol; // Set the symbol for the base
-            }
+    ByteWriter w(buffer);
+    w.bytes(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    w.u16(SNAPSHOT_VERSION);
+    w.u16(0);
+    w.i32(snapshot.nextID);
+    w.i32(snapshot.width);
+    w.i32(snapshot.height);
+    w.u32(static_cast<uint32_t>(strings.size()));
+    for (const string* value : strings) {
+        w.u32(static_cast<uint32_t>(value->size()));
+        w.bytes(value->data(), value->size());
+    }
+    w.u32(KIND_COUNT);
+    for (int k = 0; k < KIND_COUNT; ++k) {
+        w.u8(static_cast<uint8_t>(k));
+        w.u32(counts[k]);
+        w.bytes(records[k].data(), records[k].size());
+    }
+}
+
+// Decodes a snapshot written by encodeSnapshot, interning its names into
+// the palette. Version 1 files carry no board size, so out keeps the width
+// and height it holds. False if the data is damaged or inconsistent.
+bool decodeSnapshot(const char* data, size_t size, BoardSnapshot& out) {
+    ByteReader r(data, size);
+    const char* magic = r.bytes(sizeof(SNAPSHOT_MAGIC));
+    if (!magic || memcmp(magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        return false;
+    }
+    uint16_t version = r.u16();
+    if (version < 1 || version > SNAPSHOT_VERSION) {
+        return false;
+    }
+    r.u16();
+    int storedNextID = r.i32();
+    int width = out.width;
+    int height = out.height;
+    if (version >= 2) {
+        width = r.i32();
+        height = r.i32();
+    }
+
+    uint32_t stringCount = r.u32();
+    vector<string> strings;
+    for (uint32_t i = 0; i < stringCount && r.ok(); ++i) {
+        uint32_t length = r.u32();
+        const char* chars = r.bytes(length);
+        if (chars) {
+            strings.emplace_back(chars, length);
         }
-        
     }
-    void setDimensions( double h) {
-        if (0.5*h*(2 * h - 1 )< BOARD_HEIGHT * BOARD_WIDTH) {
-            height = h;
+
+    struct Record {
+        int id;
+        GeometryKey g;
+        ShapeStyle style;
+    };
+    // Palette handles of each string, interned the first time it is used
+    vector<int32_t> colorHandles(strings.size(), -1);
+    vector<int32_t> fillHandles(strings.size(), -1);
+    vector<Record> loaded;
+    uint32_t sectionCount = r.u32();
+    for (uint32_t section = 0; section < sectionCount && r.ok(); ++section) {
+        uint8_t kind = r.u8();
+        uint32_t count = r.u32();
+        if (kind > static_cast<uint8_t>(ShapeKind::Line)) {
+            return false;
         }
-        else {
-            cout << "error: shape will go out of the board" << endl;
+        for (uint32_t i = 0; i < count && r.ok(); ++i) {
+            GeometryKey g = { static_cast<ShapeKind>(kind), 0, 0, 0, 0 };
+            int id = r.i32();
+            g.x = r.i32();
+            g.y = r.i32();
+            if (g.kind == ShapeKind::Line) {
+                g.a = r.i32();
+                g.b = r.i32();
+            }
+            else {
+                g.a = r.f64();
+                if (g.kind == ShapeKind::Rectangle) {
+                    g.b = r.f64();
+                }
+            }
+            uint32_t color = r.u32();
+            uint32_t fillMode = r.u32();
+            if (!r.ok() || color >= strings.size() || fillMode >= strings.size()) {
+                return false;
+            }
+            ShapeStyle style;
+            if (colorHandles[color] < 0) {
+                if (!palette().internColor(strings[color], style.color)) {
+                    return false;
+                }
+                colorHandles[color] = style.color;
+            }
+            if (fillHandles[fillMode] < 0) {
+                if (!palette().internFill(strings[fillMode], style.fill)) {
+                    return false;
+                }
+                fillHandles[fillMode] = style.fill;
+            }
+            style.color = static_cast<ColorId>(colorHandles[color]);
+            style.fill = static_cast<FillId>(fillHandles[fillMode]);
+            loaded.push_back({ id, g, style });
+        }
+    }
+    if (!r.ok() || width <= 0 || height <= 0 || static_cast<long long>(width) * height > MAX_BOARD_CELLS) {
+        return false;
+    }
+    // IDs must be unique and below the stored next ID
+    if (storedNextID < 0 || storedNextID > MAX_SHAPE_IDS) {
+        return false;
+    }
+    vector<int> ids;
+    ids.reserve(loaded.size());
+    for (const Record& record : loaded) {
+        if (record.id < 0 || record.id >= storedNextID) {
+            return false;
         }
+        ids.push_back(record.id);
+    }
+    sort(ids.begin(), ids.end());
+    if (adjacent_find(ids.begin(), ids.end()) != ids.end()) {
+        return false;
     }
-    void setColor(const std::string& newColor) override {
-        color = newColor;
+
+    out.shapes.clear();
+    out.index.clear();
+    for (const Record& record : loaded) {
+        out.shapes.add(record.id, record.g, record.style);
+        out.index.insert(record.id, out.shapes.bounds(record.id));
     }
+    out.nextID = storedNextID;
+    out.width = width;
+    out.height = height;
+    out.changes = 0;
+    return true;
+}
+
+enum class JournalOp : uint8_t {
+    Add,
+    Remove,
+    Change,  // Geometry edited or moved
+    Paint,
+    Resize,  // Board size; before/after x and y hold width and height
+    Undo,    // Version 1 logs only; replay stops at them
+    Redo,
+    Reset    // Every shape replaced at once by clear or load
+};
+
+// One board change, with enough of the old and new state to apply it in
+// either direction.
+struct JournalEntry {
+    JournalOp op;
+    uint32_t group;
+    int32_t id;
+    GeometryKey before, after;
+    ShapeStyle styleBefore, styleAfter;
+    shared_ptr<const BoardSnapshot> boardBefore, boardAfter; // Reset only
 };
 
-class Circle : public Shapes {
+// Append-only change log, all values little-endian:
+//   header   "SHBJ", u16 version, u16 reserved
+//   records  u32 payload size, u32 FNV-1a of the payload, then the payload:
+//            u8 op, u32 group, i32 id and the op's fields (see Journal::append);
+//            a Reset holds the whole board after it as a snapshot
+// Undo and redo are logged as the changes they make, so replay never needs
+// the history from before the log. A record cut short by a crash fails its
+// size or checksum test, and replay stops there.
+const char JOURNAL_MAGIC[4] = { 'S', 'H', 'B', 'J' };
+const uint16_t JOURNAL_VERSION = 2;
+// Undo history kept in memory; the oldest groups go first
+const size_t MAX_HISTORY_ENTRIES = 1 << 18;
+
+uint32_t fnv1a(const char* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+    }
+    return hash;
+}
+
+// Undo history of the board as a list of deltas. entries[0, cursor) are
+// applied; the ones after the cursor can be redone until the next change.
+// The changes made by one command share a group and are undone together.
+// With a log file open, every change, undo and redo is also appended to it
+// and flushed once per command.
+class Journal {
 private:
-    double radius;
-public:
-    Circle(int id, int x, int y, double r, string color, string fillMode) : Shapes("Circle", id, x, y, color, fillMode), radius(r) {}
-    bool containsPoint(int pointX, int pointY) const override {
-        double distance = sqrt(pow(pointX - this->x, 2) + pow(pointY - this->y, 2));
-        return distance <= radius;
+    vector<JournalEntry> entries;
+    size_t cursor;
+    uint32_t groups;    // Last group number handed out
+    uint64_t changes;   // Changes, undos and redos so far
+    int openGroups;     // Nesting depth of beginGroup/endGroup
+    ofstream log;
+    string logPath;
+    vector<char> encoded; // Reused encoding buffer
+
+    static void writeKey(ByteWriter& w, const GeometryKey& key) {
+        w.u8(static_cast<uint8_t>(key.kind));
+        w.i32(key.x);
+        w.i32(key.y);
+        w.f64(key.a);
+        w.f64(key.b);
     }
-    string getInfo() const override {
-        return "Circle: ID=" + to_string(id) + " Radius=" + to_string(radius) +
-            " Color=" + color + " FillMode=" + fillMode +
-            " at (" + to_string(x) + "," + to_string(y) + ")";
+    static void writeName(ByteWriter& w, const string& name) {
+        w.u32(static_cast<uint32_t>(name.size()));
+        w.bytes(name.data(), name.size());
     }
-    string getLoad() const override {
-        return "Circle: " + to_string(id) + " " + to_string(x) + " " + to_string(y) + " " + to_string(radius) + " " + color + " " + fillMode;
+    void append(const JournalEntry& entry) {
+        if (!log.is_open()) {
+            return;
+        }
+        encoded.clear();
+        ByteWriter w(encoded);
+        w.u32(0); // Size and checksum, filled in below
+        w.u32(0);
+        w.u8(static_cast<uint8_t>(entry.op));
+        w.u32(entry.group);
+        w.i32(entry.id);
+        switch (entry.op) {
+        case JournalOp::Add:
+            writeKey(w, entry.after);
+            writeName(w, palette().colorName(entry.styleAfter.color));
+            writeName(w, palette().fillName(entry.styleAfter.fill));
+            break;
+        case JournalOp::Remove:
+            writeKey(w, entry.before);
+            writeName(w, palette().colorName(entry.styleBefore.color));
+            writeName(w, palette().fillName(entry.styleBefore.fill));
+            break;
+        case JournalOp::Change:
+            writeKey(w, entry.before);
+            writeKey(w, entry.after);
+            break;
+        case JournalOp::Paint:
+            writeName(w, palette().colorName(entry.styleBefore.color));
+            writeName(w, palette().colorName(entry.styleAfter.color));
+            break;
+        case JournalOp::Resize:
+            w.i32(entry.before.x);
+            w.i32(entry.before.y);
+            w.i32(entry.after.x);
+            w.i32(entry.after.y);
+            break;
+        case JournalOp::Reset:
+            encodeSnapshot(*entry.boardAfter, encoded);
+            break;
+        case JournalOp::Undo:
+        case JournalOp::Redo:
+            break;
+        }
+        uint32_t size = static_cast<uint32_t>(encoded.size() - 8);
+        uint32_t checksum = fnv1a(encoded.data() + 8, size);
+        for (int i = 0; i < 4; ++i) {
+            encoded[i] = static_cast<char>(size >> (8 * i));
+            encoded[4 + i] = static_cast<char>(checksum >> (8 * i));
+        }
+        log.write(encoded.data(), encoded.size());
     }
-    string getShape() const override {
-        return "circle";
+    void writeHeader() {
+        vector<char> header;
+        ByteWriter w(header);
+        w.bytes(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        w.u16(JOURNAL_VERSION);
+        w.u16(0);
+        log.write(header.data(), header.size());
+        log.flush();
     }
-    void drawOnBoard(vector<vector<string>>& grid) const {
-        std::string colorCode = getColorCode(color);
-        std::string resetCode = "\033[0m";
-
-        char symbolChar = (color.empty() ? '*' : color[0]); // Rename this to avoid conflict
-        std::string coloredSymbol = colorCode + std::string(1, symbolChar) + resetCode;
-
-        for (int i = -radius; i <= radius; ++i) {
-            for (int j = -radius; j <= radius; ++j) {
-                int posX = x + i; // Adjust X coordinate
-                int posY = y + j; // Adjust Y coordinate
+    // The entry that takes the board back to the state before entry.
+    static JournalEntry inverse(const JournalEntry& entry) {
+        JournalEntry inverse = entry;
+        if (entry.op == JournalOp::Add) {
+            inverse.op = JournalOp::Remove;
+        }
+        else if (entry.op == JournalOp::Remove) {
+            inverse.op = JournalOp::Add;
+        }
+        swap(inverse.before, inverse.after);
+        swap(inverse.styleBefore, inverse.styleAfter);
+        swap(inverse.boardBefore, inverse.boardAfter);
+        return inverse;
+    }
+public:
+    Journal() : cursor(0), groups(0), changes(0), openGroups(0) {}
 
-                if (posX >= 0 && posX < grid[0].size() && posY >= 0 && posY < grid.size()) {
-                    double dist = i * i + j * j;
+    void beginGroup() {
+        if (openGroups++ == 0) {
+            ++groups;
+        }
+    }
+    void endGroup() {
+        --openGroups;
+    }
+    // Records a change that has just been applied; drops the redo history.
+    void record(JournalEntry entry) {
+        entry.group = openGroups > 0 ? groups : ++groups;
+        entries.resize(cursor);
+        entries.push_back(entry);
+        ++cursor;
+        ++changes;
+        append(entry);
+    }
+    // Records a change replayed from a log; startsGroup is set on the first
+    // change of each logged group.
+    void restore(JournalEntry entry, bool startsGroup) {
+        entry.group = startsGroup ? ++groups : groups;
+        entries.resize(cursor);
+        entries.push_back(entry);
+        ++cursor;
+        ++changes;
+    }
 
-                    // Fill the circle
-                    if (fillMode == "fill") {
-                        if (dist <= radius * radius) {
-                           grid[posY][posX]= coloredSymbol;        // Store symbol
-                        }
-                    }
-                    // Draw the frame of the circle
-                    else if (fillMode == "frame") {
-                        if (dist >= (radius - 0.5) * (radius - 0.5) && dist <= (radius + 0.5) * (radius + 0.5)) {
-                           grid[posY][posX]= coloredSymbol;        // Store symbol
-                        }
-                    }
-                }
+    // The last applied group is entries[first, position()); false if none.
+    bool undoRange(size_t& first) const {
+        if (cursor == 0) {
+            return false;
+        }
+        first = cursor - 1;
+        while (first > 0 && entries[first - 1].group == entries[cursor - 1].group) {
+            --first;
+        }
+        return true;
+    }
+    // The next undone group is entries[position(), last); false if none.
+    bool redoRange(size_t& last) const {
+        if (cursor == entries.size()) {
+            return false;
+        }
+        last = cursor + 1;
+        while (last < entries.size() && entries[last].group == entries[cursor].group) {
+            ++last;
+        }
+        return true;
+    }
+    size_t position() const { return cursor; }
+    uint64_t changeCount() const { return changes; }
+    const JournalEntry& at(size_t i) const { return entries[i]; }
+    // Undo logs the inverse of each undone entry, latest first, and redo
+    // logs the entries again, each as a new group.
+    void undoneTo(size_t first) {
+        if (log.is_open()) {
+            uint32_t group = ++groups;
+            for (size_t i = cursor; i-- > first;) {
+                JournalEntry entry = inverse(entries[i]);
+                entry.group = group;
+                append(entry);
             }
         }
-
+        cursor = first;
+        ++changes;
+    }
+    void redoneTo(size_t last) {
+        if (log.is_open()) {
+            uint32_t group = ++groups;
+            for (size_t i = cursor; i < last; ++i) {
+                JournalEntry entry = entries[i];
+                entry.group = group;
+                append(entry);
+            }
+        }
+        cursor = last;
+        ++changes;
+    }
+    // Called once per command: writes out its log records, and drops the
+    // oldest whole groups once the history grows past MAX_HISTORY_ENTRIES.
+    void finishCommand() {
+        if (log.is_open()) {
+            log.flush();
+        }
+        if (entries.size() <= MAX_HISTORY_ENTRIES) {
+            return;
+        }
+        size_t drop = min(entries.size() - MAX_HISTORY_ENTRIES / 2, cursor);
+        while (drop > 0 && drop < cursor && entries[drop].group == entries[drop - 1].group) {
+            ++drop;
+        }
+        entries.erase(entries.begin(), entries.begin() + drop);
+        cursor -= drop;
     }
 
-    void setDimensions( double r) {
-        if (PI * r * r < BOARD_HEIGHT * BOARD_WIDTH) {
-            radius = r;
+    bool isLogging() const { return log.is_open(); }
+    const string& getLogPath() const { return logPath; }
+    // Appends to an existing log, or starts a new one.
+    bool openLog(const string& path) {
+        closeLog();
+        MappedFile existing(path);
+        bool fresh = !existing.isOpen() || existing.size() < sizeof(JOURNAL_MAGIC);
+        if (!fresh && memcmp(existing.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+            return false; // Not a log; leave the file alone
         }
-        else {
-            cout << "error: shape will go out of the board" << endl;
+        log.open(path, fresh ? ios::binary | ios::trunc : ios::binary | ios::app);
+        if (!log) {
+            return false;
+        }
+        if (fresh) {
+            writeHeader();
+        }
+        logPath = path;
+        return true;
+    }
+    void closeLog() {
+        if (log.is_open()) {
+            log.close();
         }
-        
+        logPath.clear();
     }
-    void setColor(const std::string& newColor) override {
-        color = newColor;
+    // Empties the log once a snapshot holds everything in it.
+    void restartLog() {
+        if (!log.is_open()) {
+            return;
+        }
+        log.close();
+        log.open(logPath, ios::binary | ios::trunc);
+        writeHeader();
     }
-};
-class Square : public Shapes {
-private:
-    double side;
-public:
-    Square(int id, int x, int y, double s, string color, string fillMode)
-        : Shapes("Square", id, x, y, color, fillMode), side(s) {}
-    bool containsPoint(int pointX, int pointY) const override {
-        int halfSide = static_cast<int>(side / 2); // Calculate half side for checking
-        return pointX >= (x - halfSide) && pointX <= (x + halfSide) &&
-            pointY >= (y - halfSide) && pointY <= (y + halfSide);
-    }
-    string getInfo() const override {
-        return "Square: ID=" + to_string(id) + " Side=" + to_string(side) +
-            " Color=" + color + " FillMode=" + fillMode +
-            " at (" + to_string(x) + "," + to_string(y) + ")";
+
+    // Decodes the record at the reader's position into entry. Names are
+    // interned into the palette. False at the end of the log or at a
+    // damaged record.
+    static bool decode(ByteReader& r, JournalEntry& entry) {
+        uint32_t size = r.u32();
+        uint32_t checksum = r.u32();
+        const char* payload = r.bytes(size);
+        if (!r.ok() || fnv1a(payload, size) != checksum) {
+            return false;
+        }
+        ByteReader p(payload, size);
+        auto readKey = [&p](GeometryKey& key) {
+            uint8_t kind = p.u8();
+            key.kind = static_cast<ShapeKind>(min<uint8_t>(kind, static_cast<uint8_t>(ShapeKind::Line)));
+            key.x = p.i32();
+            key.y = p.i32();
+            key.a = p.f64();
+            key.b = p.f64();
+            return kind <= static_cast<uint8_t>(ShapeKind::Line);
+        };
+        auto readName = [&p](std::string_view& name) {
+            uint32_t length = p.u32();
+            const char* chars = p.bytes(length);
+            name = chars ? std::string_view(chars, length) : std::string_view();
+            return chars != nullptr;
+        };
+        entry = {};
+        uint8_t op = p.u8();
+        entry.group = p.u32();
+        entry.id = p.i32();
+        std::string_view color, fill, oldColor;
+        bool ok = p.ok();
+        bool shapeOp = op <= static_cast<uint8_t>(JournalOp::Paint);
+        if (shapeOp && (entry.id < 0 || entry.id >= MAX_SHAPE_IDS)) {
+            return false;
+        }
+        switch (static_cast<JournalOp>(op)) {
+        case JournalOp::Add:
+            ok = ok && readKey(entry.after) && readName(color) && readName(fill) && palette().intern(color, fill, entry.styleAfter);
+            break;
+        case JournalOp::Remove:
+            ok = ok && readKey(entry.before) && readName(color) && readName(fill) && palette().intern(color, fill, entry.styleBefore);
+            break;
+        case JournalOp::Change:
+            ok = ok && readKey(entry.before) && readKey(entry.after);
+            break;
+        case JournalOp::Paint:
+            ok = ok && readName(oldColor) && readName(color) &&
+                palette().internColor(oldColor, entry.styleBefore.color) && palette().internColor(color, entry.styleAfter.color);
+            break;
+        case JournalOp::Resize:
+            entry.before.x = p.i32();
+            entry.before.y = p.i32();
+            entry.after.x = p.i32();
+            entry.after.y = p.i32();
+            break;
+        case JournalOp::Reset: {
+            size_t length = p.remaining();
+            const char* board = p.bytes(length);
+            shared_ptr<BoardSnapshot> after(new BoardSnapshot());
+            ok = ok && board && decodeSnapshot(board, length, *after);
+            entry.boardAfter = after;
+            break;
+        }
+        case JournalOp::Undo:
+        case JournalOp::Redo:
+            break;
+        default:
+            return false;
+        }
+        entry.op = static_cast<JournalOp>(op);
+        return ok && p.ok();
     }
+};
 
-    string getLoad() const override {
-        return "Square: " + to_string(id) + " " + to_string(x) + " " + to_string(y) +
-            " " + to_string(side) + " " + color + " " + fillMode;
+enum class WriteResult {
+    Ok,
+    OpenFailed,
+    WriteFailed
+};
+
+// Writes data to "<filename>.tmp" and renames it over filename, so a crash
+// leaves either the old file or the new one, never half of each.
+WriteResult writeFileAtomically(const string& filename, const vector<char>& data) {
+    string temporary = filename + ".tmp";
+    ofstream file(temporary, ios::binary | ios::trunc);
+    if (!file) {
+        return WriteResult::OpenFailed;
     }
-    string getShape() const override {
-        return "square";
+    file.write(data.data(), data.size());
+    file.close();
+    if (!file) {
+        std::remove(temporary.c_str());
+        return WriteResult::WriteFailed;
     }
-    void setColor(const std::string& newColor) override {
-        color = newColor;
+#ifdef _WIN32
+    bool renamed = MoveFileExA(temporary.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    int fd = open(temporary.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd); // The data must be on disk before the rename is
+        close(fd);
     }
-    void setDimensions(double s) {
-        if (s * s < BOARD_HEIGHT * BOARD_WIDTH) {
-            side = s;
+    bool renamed = std::rename(temporary.c_str(), filename.c_str()) == 0;
+#endif
+    if (!renamed) {
+        std::remove(temporary.c_str());
+        return WriteResult::WriteFailed;
+    }
+    return WriteResult::Ok;
+}
+
+// Writes snapshots on a background thread. submit() only hands over a
+// snapshot and the time to write it, and returns; the worker sleeps until
+// then, so a save falls due even while no commands arrive. A newer
+// snapshot replaces one that has not been started. Finished snapshots are
+// handed back through collect(). Any thread may release shared storage,
+// as server readers do with the versions they mirror: reference counts are
+// atomic, and a writer that finds itself the only owner of a chunk issues
+// an acquire fence that pairs with the release in the last other owner's
+// drop (see ChunkedArray::write), so it never changes a chunk while
+// another thread can still read it.
+class Autosaver {
+private:
+    thread worker;
+    mutex lock;
+    condition_variable wake;
+    unique_ptr<BoardSnapshot> pending;            // Newest snapshot, not started yet
+    string pendingPath;
+    chrono::steady_clock::time_point pendingDue;  // When to write it
+    vector<unique_ptr<BoardSnapshot>> finished;   // Written; released by collect()
+    vector<string> failedPaths;
+    bool stopping;
+
+    void work() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return pending || stopping; });
+            if (!pending) {
+                return; // Stopping, and everything submitted has been written
+            }
+            if (!stopping && chrono::steady_clock::now() < pendingDue) {
+                wake.wait_until(guard, pendingDue); // Or until replaced or stopped
+                continue;
+            }
+            unique_ptr<BoardSnapshot> snapshot = std::move(pending);
+            string path = pendingPath;
+            guard.unlock();
+
+            vector<char> buffer;
+            encodeSnapshot(*snapshot, buffer);
+            bool ok = writeFileAtomically(path, buffer) == WriteResult::Ok;
+
+            guard.lock();
+            finished.push_back(std::move(snapshot));
+            if (!ok) {
+                failedPaths.push_back(path);
+            }
         }
-        else {
-            cout << "error: shape will go out of the board" << endl;
+    }
+public:
+    Autosaver() : stopping(false) {}
+    ~Autosaver() { finish(); }
+
+    // Waits for the last submitted snapshot to be written.
+    void finish() {
+        if (worker.joinable()) {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_one();
+            worker.join();
         }
-       
     }
-    void drawOnBoard(vector<vector<string>>& grid) const override {
-        int startX = x;
-        int startY = y;
-        int sideInt = side;
 
-        std::string colorCode = getColorCode(color);
-        std::string resetCode = "\033[0m";
-        char symbolB = color.empty() ? '*' : color[0]; // Default symbol if color is empty
-        string symbol = colorCode + std::string(1, symbolB) + resetCode;
-        // Fill the square
-        if (fillMode == "fill") {
-            for (int i = 0; i < sideInt; ++i) {
-                for (int j = 0; j < sideInt; ++j) {
-                    int posX = startX + j;
-                    int posY = startY + i;
-
-                    if (posX >= 0 && posX < BOARD_WIDTH && posY >= 0 && posY < BOARD_HEIGHT) {
-                        grid[posY][posX]=symbol; // Store the symbol
-                    }
-                }
+    void submit(unique_ptr<BoardSnapshot> snapshot, const string& path, chrono::steady_clock::time_point due) {
+        unique_ptr<BoardSnapshot> replaced;
+        {
+            lock_guard<mutex> guard(lock);
+            replaced = std::move(pending);
+            pending = std::move(snapshot);
+            pendingPath = path;
+            pendingDue = due;
+            if (!worker.joinable()) {
+                stopping = false;
+                worker = thread(&Autosaver::work, this);
             }
         }
+        wake.notify_one();
+    }
+    // Drops a snapshot that has not been started.
+    void discard() {
+        unique_ptr<BoardSnapshot> dropped;
+        lock_guard<mutex> guard(lock);
+        dropped = std::move(pending);
+    }
+    // Releases written snapshots; returns the paths of failed writes.
+    vector<string> collect() {
+        vector<unique_ptr<BoardSnapshot>> done;
+        vector<string> failed;
+        {
+            lock_guard<mutex> guard(lock);
+            done.swap(finished);
+            failed.swap(failedPaths);
+        }
+        return failed;
+    }
+};
 
-        // Draw the borders of the square
-        for (int i = 0; i < sideInt; ++i) {
-            // Top border
-            if (startY >= 0 && startY < BOARD_HEIGHT) {
-                if (startX + i >= 0 && startX + i < BOARD_WIDTH) {
-                    grid[startY][startX + i]=symbol; // Store the symbol for top border
-                }
+// Immutable versions of a value, published by one writer thread and read by
+// any number of others (epoch-based reclamation). A reader announces the
+// epoch it starts in, reads the current version and clears its slot again;
+// the writer frees a replaced version once no reader announced an epoch
+// from before the replacement. Readers never lock or wait, and unlike an
+// atomic shared_ptr they touch no reference count.
+template <typename T>
+class EpochVersions {
+public:
+    static const int MAX_READERS = 64;
+private:
+    static const uint64_t IDLE = ~uint64_t(0);
+    struct alignas(64) ReaderSlot {  // One cache line each; readers write them on every read
+        atomic<bool> claimed{ false };
+        atomic<uint64_t> epoch{ IDLE };
+    };
+    struct Retired {
+        uint64_t epoch;  // Epoch that replaced the version
+        const T* version;
+    };
+    atomic<const T*> current;
+    atomic<uint64_t> epoch;
+    ReaderSlot readers[MAX_READERS];
+    vector<Retired> retired;  // Writer only
 
-                // Bottom border
-                if (startY + sideInt - 1 >= 0 && startY + sideInt - 1 < BOARD_HEIGHT &&
-                    startX + i >= 0 && startX + i < BOARD_WIDTH) {
-                    grid[startY + sideInt - 1][startX + i]=symbol; // Store the symbol for bottom border
-                }
+    void reclaim() {
+        uint64_t oldest = IDLE;
+        for (const ReaderSlot& reader : readers) {
+            oldest = min(oldest, reader.epoch.load());
+        }
+        size_t kept = 0;
+        for (const Retired& old : retired) {
+            if (old.epoch <= oldest) {
+                delete old.version;
+            }
+            else {
+                retired[kept++] = old;
             }
         }
+        retired.resize(kept);
+    }
+public:
+    EpochVersions() : current(nullptr), epoch(1) {}
+    // Every reader must have left.
+    ~EpochVersions() {
+        for (const Retired& old : retired) {
+            delete old.version;
+        }
+        delete current.load();
+    }
+    EpochVersions(const EpochVersions&) = delete;
+    EpochVersions& operator=(const EpochVersions&) = delete;
+
+    // Writer: makes version current and frees the replaced ones no reader
+    // can still see.
+    void publish(unique_ptr<T> version) {
+        const T* old = current.exchange(version.release());
+        uint64_t replacedIn = epoch.fetch_add(1) + 1;
+        if (old) {
+            retired.push_back({ replacedIn, old });
+        }
+        reclaim();
+    }
+    bool hasVersion() const { return current.load(memory_order_relaxed) != nullptr; }
 
-        for (int i = 0; i < sideInt; ++i) {
-            // Left border
-            if (startY + i >= 0 && startY + i < BOARD_HEIGHT && startX >= 0 && startX < BOARD_WIDTH) {
-                grid[startY + i][startX]=symbol; // Store the symbol for left border
+    // Reader: claims a slot for this thread, or returns -1 if all are taken.
+    int join() {
+        for (int i = 0; i < MAX_READERS; ++i) {
+            bool free = false;
+            if (readers[i].claimed.compare_exchange_strong(free, true, memory_order_acquire)) {
+                return i;
             }
+        }
+        return -1;
+    }
+    void leave(int slot) {
+        readers[slot].claimed.store(false, memory_order_release);
+    }
+    // Calls fn with the current version, which stays valid until fn returns.
+    // There must be one.
+    template <typename Fn>
+    void read(int slot, Fn fn) {
+        ReaderSlot& reader = readers[slot];
+        reader.epoch.store(epoch.load());
+        fn(*current.load());
+        reader.epoch.store(IDLE, memory_order_release);
+    }
+};
+
+class Board {
+private:
+    FrameBuffer grid;
+    TerminalRenderer terminal;
+    ShapeStore shapes;
+    int nextID;
+    int lastSelectedId;
+    SpatialIndex index;   // Bounding boxes of all shapes, for redraw and off-board picks
+    unordered_map<GeometryKey, int, GeometryKeyHash> occupied; // Shapes per exact geometry
+    vector<Rect> damage;  // Board areas changed since the last draw
+    bool fullRedraw;
+    int renderThreads;    // Bands draw() may render in parallel
+    bool viewing;         // Printing a viewport instead of the whole board
+    int viewX, viewY;     // Board cell at the viewport's top-left corner
+    int viewZoom;         // Board cells per viewport cell each way; a power of two
+    FrameBuffer viewFrame;
+    MipChain mips;        // Zoomed-out levels of grid, kept while a view uses them
+    Journal journal;      // Undo/redo history and optional change log
+
+    Autosaver autosaver;
+    string autosavePath;  // Empty while autosave is off
+    int autosaveChanges;  // Save after this many changes...
+    int autosaveSeconds;  // ...or once this long has passed with any change
+    uint64_t autosavedAt; // journal.changeCount() at the last autosave
+    chrono::steady_clock::time_point lastAutosave;
+    uint64_t autosaveQueuedAt;                    // changeCount() of the last snapshot handed over
+    chrono::steady_clock::time_point autosaveDue; // When that one is written, if it waits for the timer
+
+    EpochVersions<BoardSnapshot> versions;  // For readers on other threads
+    uint64_t publishedAt;                   // changeCount() of the current version
+
+    static const int MIN_BAND_ROWS = 32;
+
+    static const size_t MAX_DAMAGE_RECTS = 32;
+    static const int MAX_ZOOM = 64;
+    static const size_t MAX_OCCLUDERS = 8;  // Filled boxes renderArea tests each shape against
+
+    ostream* messages;    // Status and error messages; a quiet stream in batch mode
+    ostream* fileErrors;  // File errors, normally cerr
+    int failures;         // Errors reported so far
+
+    ostream& say() const { return *messages; }
+    ostream& fail() {
+        ++failures;
+        return *messages;
+    }
+    ostream& failFile() {
+        ++failures;
+        return *fileErrors;
+    }
 
-            // Right border
-            if (startY + i >= 0 && startY + i < BOARD_HEIGHT &&
-                startX + sideInt - 1 >= 0 && startX + sideInt - 1 < BOARD_WIDTH) {
-                grid[startY + i][startX + sideInt - 1]=symbol; // Store the symbol for right border
+    void invalidate(const Rect& area) {
+        Rect clipped = area.intersected(grid.bounds());
+        if (fullRedraw || clipped.empty()) {
+            return;
+        }
+        damage.push_back(clipped);
+        limitDamage();
+    }
+    void limitDamage() {
+        if (damage.size() > MAX_DAMAGE_RECTS) {
+            // Too many small regions: collapse them into one covering rectangle
+            Rect total = damage[0];
+            for (const Rect& r : damage) {
+                total = total.united(r);
             }
+            damage.assign(1, total);
+        }
+    }
+    double boardArea() const {
+        return static_cast<double>(grid.getWidth()) * grid.getHeight();
+    }
+    bool setSize(int width, int height) {
+        if (width <= 0 || height <= 0 || static_cast<long long>(width) * height > MAX_BOARD_CELLS) {
+            return false;
+        }
+        if (width != grid.getWidth() || height != grid.getHeight()) {
+            grid = FrameBuffer(width, height);
+            mips.clear();
+            invalidateAll();
+        }
+        return true;
+    }
+    // link/unlink keep the damage list, spatial index and duplicate set in
+    // step with a shape; geometry changes are wrapped in unlink ... link,
+    // and link refreshes the shape's cached bounds.
+    void link(int id) {
+        Rect bounds = shapes.updateBounds(id);
+        invalidate(bounds);
+        index.insert(id, bounds);
+        ++occupied[shapes.key(id)];
+    }
+    void unlink(int id) {
+        invalidate(shapes.bounds(id));
+        index.remove(id);
+        auto it = occupied.find(shapes.key(id));
+        if (it != occupied.end() && --it->second == 0) {
+            occupied.erase(it);
+        }
+    }
+    // Gives the shape the next ID. IDs are never reused, and files with IDs
+    // past MAX_SHAPE_IDS would not load, so adding stops there.
+    template <typename Geometry>
+    void addShape(const Geometry& shape, ShapeStyle style) {
+        if (nextID >= MAX_SHAPE_IDS) {
+            fail() << "Error: No shape IDs left; the board has had " << MAX_SHAPE_IDS << " shapes.\n";
+            return;
         }
-
+        int id = nextID++;
+        shapes.add(id, shape, style);
+        link(id);
+        journal.record({ JournalOp::Add, 0, id, {}, shape.getKey(), {}, style, {}, {} });
     }
 
-};
-class Rectangle : public Shapes {
-private:
-    double  width, height;
-public:
-    Rectangle(int id, int x, int y, double w, double h, string color, string fillMode) : Shapes("Rectangle", id, x, y, color, fillMode), width(w), height(h) {}
-    bool containsPoint(int pointX, int pointY) const override {
-        int halfWidth = static_cast<int>(width / 2);
-        int halfHeight = static_cast<int>(height / 2);
-
-        return pointX >= (x - halfWidth) && pointX <= (x + halfWidth) &&
-            pointY >= (y - halfHeight) && pointY <= (y + halfHeight);
+    // Unrecorded changes, used to apply journal entries in either direction.
+    void placeShape(int id, const GeometryKey& key, ShapeStyle style) {
+        if (shapes.contains(id)) {
+            eraseShape(id);
+        }
+        shapes.add(id, key, style);
+        link(id);
+        nextID = max(nextID, id + 1);
     }
-    string getInfo() const override {
-        return "Rectangle: top-left corner (" + std::to_string(x) + ", " + std::to_string(y) +
-            "), width " + std::to_string(width) + ", height " + std::to_string(height) + " Color=" + color + " FillMode=" + fillMode;
+    void eraseShape(int id) {
+        unlink(id);
+        shapes.remove(id);
     }
-    string getLoad() const override {
-        return "Rectangle: " + to_string(getID()) + " " + to_string(getX()) + " " + to_string(getY()) + " " + to_string(width) + " " + to_string(height) + " " + color + " " + fillMode;
+    void reshape(int id, const GeometryKey& key) {
+        ShapeStyle style = shapes.style(id);
+        unlink(id);
+        shapes.add(id, key, style);
+        link(id);
     }
-    string getShape() const override {
-        return "rectangle";
+    void restyle(int id, ShapeStyle style) {
+        invalidate(shapes.bounds(id));
+        shapes.setColor(id, style.color);
     }
-    void drawOnBoard(vector<vector<string>>& grid) const override {
-        int startX = x;
-        int startY = y;
-        int heightInt = height;
-        int widthInt = width;
-        std::string colorCode = getColorCode(color);
-        std::string resetCode = "\033[0m";
-        char colorSymbol = color.empty() ? '*' : color[0]; // Default to '*' if color is empty
-        string symbol = colorCode + std::string(1, colorSymbol) + resetCode;
-
-        // Fill the rectangle
-        if (fillMode == "fill") {
-            for (int i = 0; i < heightInt; ++i) {
-                for (int j = 0; j < widthInt; ++j) {
-                    int posX = startX + j; // Calculate x position
-                    int posY = startY + i; // Calculate y position
-
-                    // Check bounds before filling
-                    if (posX >= 0 && posX < grid[0].size() && posY < grid.size()) {
-                        grid[posY][posX]=symbol; // Fill the rectangle with the color symbol
-                    }
-                }
+    // False if the entry does not fit the board's current state.
+    bool apply(const JournalEntry& entry, bool forward) {
+        bool present = shapes.contains(entry.id);
+        switch (entry.op) {
+        case JournalOp::Add:
+        case JournalOp::Remove:
+            if ((entry.op == JournalOp::Add) == forward) {
+                placeShape(entry.id, forward ? entry.after : entry.before, forward ? entry.styleAfter : entry.styleBefore);
             }
-        }
-
-        // Optionally, you can still draw the outline if needed
-        for (int i = 0; i < widthInt; ++i) {
-            // Top border
-            if (startY < grid.size()) {
-                if (startX + i < grid[0].size()) {
-                    grid[startY][startX + i]=symbol; // Top side
-                }
-
-                // Bottom border
-                if (startY + heightInt - 1 < grid.size() && startX + i < grid[0].size()) {
-                    grid[startY + heightInt - 1][startX + i]=symbol; // Bottom side
-                }
+            else if (present) {
+                eraseShape(entry.id);
             }
-        }
-
-        for (int i = 0; i < heightInt; ++i) {
-            // Left border
-            if (startY + i < grid.size() && startX < grid[0].size()) {
-                grid[startY + i][startX]=symbol; // Left side
+            else {
+                return false;
             }
-
-            // Right border
-            if (startY + i < grid.size() && startX + widthInt - 1 < grid[0].size()) {
-                grid[startY + i][startX + widthInt - 1]=symbol; // Right side
+            return true;
+        case JournalOp::Change:
+            if (!present || shapes.kindOf(entry.id) != entry.after.kind) {
+                return false;
+            }
+            reshape(entry.id, forward ? entry.after : entry.before);
+            return true;
+        case JournalOp::Paint:
+            if (!present) {
+                return false;
             }
+            restyle(entry.id, forward ? entry.styleAfter : entry.styleBefore);
+            return true;
+        case JournalOp::Resize:
+            return forward ? setSize(entry.after.x, entry.after.y) : setSize(entry.before.x, entry.before.y);
+        case JournalOp::Reset:
+            restoreShapes(forward ? *entry.boardAfter : *entry.boardBefore);
+            return true;
+        default:
+            return false;
         }
     }
-
-    void setDimensions(double w, double h) {
-        if (w * h < BOARD_HEIGHT * BOARD_WIDTH) {
-            width = w;
-            height = h;
+    // Takes the shapes, index and next ID of a snapshot, sharing their
+    // storage. Unrecorded.
+    void restoreShapes(const BoardSnapshot& state) {
+        invalidateAll();
+        shapes = state.shapes;
+        index = state.index;
+        occupied.clear();
+        shapes.forEach([&](int, const auto& shape, ShapeStyle) { ++occupied[shape.getKey()]; });
+        nextID = state.nextID;
+    }
+    // Replaces every shape, journaled as a single entry holding the shapes
+    // before and after.
+    void resetShapes(shared_ptr<const BoardSnapshot> after) {
+        shared_ptr<const BoardSnapshot> before(snapshot());
+        restoreShapes(*after);
+        journal.record({ JournalOp::Reset, 0, NO_SHAPE, {}, {}, {}, {}, before, after });
+    }
+    void recordChange(int id, const GeometryKey& before) {
+        GeometryKey after = shapes.key(id);
+        if (!(after == before)) {
+            journal.record({ JournalOp::Change, 0, id, before, after, {}, {}, {}, {} });
         }
-        else {
-            cout << "error: shape will go out of the board" << endl;
-                
+    }
+    bool resizeBoard(int width, int height) {
+        GeometryKey before = { ShapeKind::Triangle, grid.getWidth(), grid.getHeight(), 0, 0 };
+        if (!setSize(width, height)) {
+            return false;
         }
-        
+        if (before.x != width || before.y != height) {
+            journal.record({ JournalOp::Resize, 0, NO_SHAPE, before, { ShapeKind::Triangle, width, height, 0, 0 }, {}, {}, {}, {} });
+        }
+        return true;
     }
-    void setColor(const std::string& newColor) override {
-        color = newColor;
+public:
+    Board() : grid(DEFAULT_BOARD_WIDTH, DEFAULT_BOARD_HEIGHT), nextID(0), lastSelectedId(-1), fullRedraw(true), renderThreads(1),
+        viewing(false), viewX(0), viewY(0), viewZoom(1), viewFrame(0, 0),
+        autosaveChanges(0), autosaveSeconds(0), autosavedAt(0), autosaveQueuedAt(0), publishedAt(0), messages(&cout), fileErrors(&cerr), failures(0) {}
+    ~Board() {
+        // One last autosave for the changes since the previous one
+        if (!autosavePath.empty() && journal.changeCount() != autosavedAt) {
+            autosaver.submit(snapshot(), autosavePath, chrono::steady_clock::now());
+        }
+        autosaver.finish();
+        for (const string& path : autosaver.collect()) {
+            failFile() << "Error: Autosave to " << path << " failed.\n";
+        }
     }
-};
 
-class Line : public Shapes {
-private:
-    int x1, y1, x2, y2;
-public:
+    // Where command output goes; batch mode points both at a quiet stream.
+    void setMessages(ostream& status, ostream& errors) {
+        messages = &status;
+        fileErrors = &errors;
+    }
+    // Number of errors reported so far; a command failed if it went up.
+    int getFailures() const { return failures; }
 
-    Line(int id, int x1, int y1, int x2, int y2, string color, string fillMode)
-        : Shapes("Line", id, x1, y1, color, fillMode), x1(x1), y1(y1), x2(x2), y2(y2) {}
-    bool containsPoint(int x, int y) const override{
-        // Check if (x, y) is on the line segment from (x1, y1) to (x2, y2)
-        return (y - y1) * (x2 - x1) == (y2 - y1) * (x - x1) && // Collinear check
-            x >= min(x1, x2) && x <= max(x1, x2) &&
-            y >= min(y1, y2) && y <= max(y1, y2);
+    // The next draw repaints the whole board.
+    void invalidateAll() {
+        fullRedraw = true;
+        damage.clear();
     }
-    void setDimensions(int x, int y, int z, int t) {
-        x1 = x;
-        y1 = y;
-        x2 = z;
-        y2 = t;
+
+    bool isOccupied(const GeometryKey& key) const {
+#if SHAPES_STATS
+        STAT_ADD(occupancyChecks, 1);
+        STAT_ADD(occupancyCompared, occupied.bucket_count() > 0 ? occupied.bucket_size(occupied.bucket(key)) : 0);
+#endif
+        return occupied.find(key) != occupied.end();
     }
-    void drawOnBoard(vector<vector<string>>& grid) const override {
-        std::string colorCode = getColorCode(color);
-        std::string resetCode = "\033[0m";
-        char symbolB = color.empty() ? '*' : color[0]; // Default to '*' if color is empty
-        string symbol = colorCode + std::string(1, symbolB) + resetCode;
-        int dx = abs(x2 - x1);
-        int dy = abs(y2 - y1);
-        int sx = (x1 < x2) ? 1 : -1;
-        int sy = (y1 < y2) ? 1 : -1;
-        int err = dx - dy;
 
-        int x = x1;
-        int y = y1;
+    void print() {
+        print(cout);
+    }
+    void print(ostream& out) {
+        terminal.print(viewing ? viewFrame : grid, out);
+    }
+    void setLiveMode(bool on) {
+        terminal.setLive(on);
+        say() << "Live mode " << (on ? "on" : "off") << ".\n";
+    }
+    // Clears the area and redraws every shape overlapping it, in z-order.
+    // Shapes whose visible part lies inside a later filled square or
+    // rectangle are skipped, since every cell they draw gets painted over.
+    void renderArea(const Rect& area) {
+        grid.clear(area);
+        RasterTarget target = grid.view(area);
+        const Rect clip = target.getClip();
+        STAT_ADD(renders, 1);
+        STAT_ADD(renderCells, static_cast<uint64_t>(clip.right - clip.left) * (clip.bottom - clip.top));
+        vector<int> ids = index.query(clip);
 
-        while (true) {
-            if (x >= 0 && x < BOARD_WIDTH && y >= 0 && y < BOARD_HEIGHT) {
-                grid[y][x] = symbol;
+        // Top-most first, keeping the largest boxes seen so far as occluders
+        auto cells = [](const Rect& r) { return static_cast<long long>(r.right - r.left) * (r.bottom - r.top); };
+        vector<Rect> occluders;
+        for (size_t i = ids.size(); i-- > 0;) {
+            Rect visible = shapes.bounds(ids[i]).intersected(clip);
+            bool covered = false;
+            for (size_t k = 0; k < occluders.size() && !covered; ++k) {
+                covered = occluders[k].covers(visible);
             }
-
-            if (x == x2 && y == y2) break;
-
-            int e2 = err;
-
-            if (e2 > -dy) {
-                err -= dy;
-                x += sx;
+            if (covered || visible.empty()) {
+                if (covered) {
+                    STAT_ADD(renderOccluded, 1); // Still far cheaper than drawing the shape
+                }
+                ids[i] = NO_SHAPE;
+                continue;
+            }
+            if (!shapes.fillsBounds(ids[i])) {
+                continue;
             }
+            if (occluders.size() < MAX_OCCLUDERS) {
+                occluders.push_back(visible);
+            }
+            else {
+                auto smallest = min_element(occluders.begin(), occluders.end(),
+                    [&](const Rect& a, const Rect& b) { return cells(a) < cells(b); });
+                if (cells(*smallest) < cells(visible)) {
+                    *smallest = visible;
+                }
+            }
+        }
 
-            if (e2 < dx) {
-                err += dx;
-                y += sy;
+#if SHAPES_STATS
+        DrawTally tally;
+#endif
+        for (int id : ids) {
+            if (id == NO_SHAPE) {
+                continue;
             }
+            shapes.visit(id, [&](const auto& shape, ShapeStyle style) {
+                target.setShape(id);
+#if SHAPES_STATS
+                tally.draw(static_cast<int>(shape.kind), target, [&]() {
+                    shape.drawOnBoard(target, shapes.symbol(style), shapes.fillMode(style));
+                });
+#else
+                shape.drawOnBoard(target, shapes.symbol(style), shapes.fillMode(style));
+#endif
+            });
         }
-    }
-    void setColor(const std::string& newColor) override {
-        color = newColor;
+#if SHAPES_STATS
+        tally.flush();
+#endif
     }
 
- 
-    string getInfo() const override {
-        return "Line: from (" + std::to_string(x1) + ", " + std::to_string(y1) + ") to (" +
-            std::to_string(x2) + ", " + std::to_string(y2) + ")" +
-            " Color=" + color + " FillMode=" + fillMode;
-    }
-    string getLoad() const override {
-        return "Line: " + std::to_string(id) + " " + std::to_string(x1) + " " +
-            std::to_string(y1) + " " + std::to_string(x2) + " " + std::to_string(y2) + " " + color + " " + fillMode;
-    }
-};
+    // Splits the area into horizontal bands rendered on separate threads.
+    // Each band sees every overlapping shape in z-order, so the result is
+    // the same as a serial render.
+    void renderBanded(const Rect& area) {
+        Rect clipped = area.intersected(grid.bounds());
+        int rows = clipped.bottom - clipped.top;
+        int bands = min(renderThreads, rows / MIN_BAND_ROWS);
+        if (bands <= 1) {
+            renderArea(clipped);
+            return;
+        }
 
-class Board {
-private:
-    vector<vector<string>> grid; 
-    map<int, std::unique_ptr<Shapes>> shapes;    
-    int nextID;
-    int lastSelectedId;
-public:
-    Board() : grid(BOARD_HEIGHT, std::vector<std::string>(BOARD_WIDTH, " ")), nextID(0), lastSelectedId(-1) {}
-
-    bool isOccupied(int x, int y, const string& type, double param1 = 0, double param2 = 0) {
-        for (const auto& shapePair : shapes) {
-            const Shapes* shape = shapePair.second.get();
-            if (shape->getShape() == type) {
-                double shapeX = shape->getX();
-                double shapeY = shape->getY();
-
-                if (shapeX == x && shapeY == y) {
-                    if (type == "circle") {
-                        const Circle* circle = dynamic_cast<const Circle*>(shape);
-                        if (circle && circle->getShape() == type && circle->getX() == x && circle->getY() == y && circle->getInfo().find(to_string(param1)) != string::npos) {
-                            return true;
-                        }
-                    }
-                    else if (type == "square") {
-                        const Square* square = dynamic_cast<const Square*>(shape);
-                        if (square && square->getShape() == type && square->getX() == x && square->getY() == y && square->getInfo().find(to_string(param1)) != string::npos) {
-                            return true;
-                        }
-                    }
-                    else if (type == "triangle") {
-                        const Triangle* triangle = dynamic_cast<const Triangle*>(shape);
-                        if (triangle && triangle->getShape() == type && triangle->getX() == x && triangle->getY() == y && triangle->getInfo().find(to_string(param1)) != string::npos) {
-                            return true;
-                        }
-                    }
-                    else if (type == "rectangle") {
-                        const Rectangle* rectangle = dynamic_cast<const Rectangle*>(shape);
+        vector<std::thread> workers;
+        workers.reserve(bands - 1);
+        for (int band = 1; band < bands; ++band) {
+            Rect part = { clipped.left, clipped.top + rows * band / bands, clipped.right, clipped.top + rows * (band + 1) / bands };
+            workers.emplace_back([this, part]() { renderArea(part); });
+        }
+        renderArea({ clipped.left, clipped.top, clipped.right, clipped.top + rows / bands });
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
 
-                        if (rectangle && rectangle->getShape() == type && rectangle->getX() == x && rectangle->getY() == y &&
-                            rectangle->getInfo().find(to_string(param1)) != string::npos && rectangle->getInfo().find(to_string(param2)) != string::npos) {
-                            return true;
-                        }
-                    }
-                    // Додавання перевірки для лінії
-                    else if (type == "line") {
-                        const Line* line = dynamic_cast<const Line*>(shape);
-                        if (line && line->getShape() == type &&
-                            line->getInfo().find(to_string(x)) != string::npos &&
-                            line->getInfo().find(to_string(y)) != string::npos &&
-                            line->getInfo().find(to_string(param1)) != string::npos &&
-                            line->getInfo().find(to_string(param2)) != string::npos) {
-                            return true;
-                        }
-                    }
+    // Repaints the damaged parts of area; damage elsewhere stays pending
+    // until a draw or pick needs it.
+    void refresh(const Rect& area) {
+        Rect bounds = grid.bounds();
+        if (fullRedraw) {
+            fullRedraw = false;
+            damage.assign(1, bounds);
+        }
+        vector<Rect> pending;
+        for (const Rect& r : damage) {
+            Rect part = r.intersected(area);
+            if (part.empty()) {
+                pending.push_back(r);
+                continue;
+            }
+            // Repaint only the damaged areas, keeping the z-order of the shapes
+            renderBanded(part);
+            mips.update(grid, part);
+            // Keep what is left of r: the bands above and below the part,
+            // then the pieces to its left and right
+            for (const Rect& rest : { Rect{ r.left, r.top, r.right, part.top }, Rect{ r.left, part.bottom, r.right, r.bottom },
+                    Rect{ r.left, part.top, part.left, part.bottom }, Rect{ part.right, part.top, r.right, part.bottom } }) {
+                if (!rest.empty()) {
+                    pending.push_back(rest);
                 }
             }
         }
-        return false;
+        damage.swap(pending);
+        limitDamage();
     }
-
-    void print() {
-        cout << "+";
-        for (int i = 0; i < BOARD_WIDTH; ++i) {
-            cout << "-";
+    // Board cells that get printed: all of them, or those under the viewport.
+    Rect visibleArea() const {
+        if (!viewing) {
+            return grid.bounds();
         }
-        cout << "+" << "\n";
-
-        for (const auto& row : grid) {
-            cout << "|";
-            for (const string& c : row) {
-                cout << c;
+        long long right = viewX + static_cast<long long>(viewFrame.getWidth()) * viewZoom;
+        long long bottom = viewY + static_cast<long long>(viewFrame.getHeight()) * viewZoom;
+        return Rect{ viewX, viewY, static_cast<int>(min<long long>(right, grid.getWidth())),
+            static_cast<int>(min<long long>(bottom, grid.getHeight())) }.intersected(grid.bounds());
+    }
+    // Fills the viewport from the board, or from its mip level when zoomed out.
+    void composeView() {
+        int level = 0;
+        while ((1 << level) < viewZoom) {
+            ++level;
+        }
+        mips.build(grid, level);
+        viewFrame.clear();
+        int levelWidth = mips.getWidth(grid, level);
+        int levelHeight = mips.getHeight(grid, level);
+        int left = viewX / viewZoom;
+        int top = viewY / viewZoom;
+        long long first = max(left, 0);
+        long long last = min<long long>(static_cast<long long>(left) + viewFrame.getWidth(), levelWidth);
+        for (int row = 0; row < viewFrame.getHeight() && first < last; ++row) {
+            long long y = static_cast<long long>(top) + row;
+            if (y >= 0 && y < levelHeight) {
+                const Cell* source = mips.row(grid, level, static_cast<int>(y));
+                viewFrame.putSpan(row, static_cast<int>(first - left), source + first, static_cast<int>(last - first));
             }
-            cout << "|" << "\n";
         }
+    }
+    // Brings the board up to date where it will be printed.
+    void draw() {
+        refresh(visibleArea());
+        if (viewing) {
+            composeView();
+        }
+    }
 
-        std::cout << "+";
-        for (int i = 0; i < BOARD_WIDTH; ++i) {
-            std::cout << "-";
+    int getWidth() const { return grid.getWidth(); }
+    int getHeight() const { return grid.getHeight(); }
+    void resize(int width, int height) {
+        if (!resizeBoard(width, height)) {
+            fail() << "Error: invalid board size " << width << "x" << height << ".\n";
+            return;
         }
-        std::cout << "+" << "\n";
+        say() << "Board resized to " << width << "x" << height << ".\n";
     }
-    void draw() {
-        for (auto& row : grid) {
-            fill(row.begin(), row.end(), " ");
+
+    // Prints only a width x height window of the board from (x, y) on, each
+    // cell standing for zoom x zoom board cells. x and y are rounded down
+    // to a multiple of zoom, so zoomed cells line up with the mip levels.
+    // Only the cells under the window are rasterized.
+    void setView(int x, int y, int width, int height, int zoom) {
+        if (width <= 0 || height <= 0 || static_cast<long long>(width) * height > MAX_BOARD_CELLS) {
+            fail() << "Error: invalid view size " << width << "x" << height << ".\n";
+            return;
         }
+        if (zoom < 1 || zoom > MAX_ZOOM || (zoom & (zoom - 1)) != 0) {
+            fail() << "Error: Zoom must be a power of two up to " << MAX_ZOOM << ".\n";
+            return;
+        }
+        viewing = true;
+        viewX = x - (x % zoom + zoom) % zoom;
+        viewY = y - (y % zoom + zoom) % zoom;
+        viewZoom = zoom;
+        if (width != viewFrame.getWidth() || height != viewFrame.getHeight()) {
+            viewFrame = FrameBuffer(width, height);
+        }
+        say() << "Viewing " << width << "x" << height << " from (" << viewX << ", " << viewY << ") at zoom " << zoom << ".\n";
+    }
+    void clearView() {
+        viewing = false;
+        viewFrame = FrameBuffer(0, 0);
+        mips.clear();
+        say() << "Viewing the whole board.\n";
+    }
 
-        for (const auto& shapePair : shapes) {
-            shapePair.second->drawOnBoard(grid);
+    void setRenderThreads(int count) {
+        if (count <= 0) {
+            count = max(1u, std::thread::hardware_concurrency());
         }
+        renderThreads = count;
+        say() << "Rendering with " << renderThreads << " thread(s).\n";
     }
 
     void list() {
         if (shapes.empty()) {
-            cout << "No shapes added yet.\n";
+            say() << "No shapes added yet.\n";
         }
         else {
-            cout << "List of shapes on the board:\n";
-            for (const auto& shapePair : shapes) {
-                cout << shapePair.second->getInfo() << endl;
-            }
+            say() << "List of shapes on the board:\n";
+            shapes.forEach([&](int id, const auto& shape, ShapeStyle style) {
+                say() << shape.getInfo(id, shapes.colorName(style), shapes.fillName(style)) << endl;
+            });
         }
     }
 
-    bool isInBounds(int x, int y) const {
+    bool isInBounds(int x, int y) {
         if (x < 0 || y < 0) {
-            cout << "err1" << endl;
+            say() << "err1" << endl;
             return false;
         }
-        if (x > BOARD_WIDTH || y > BOARD_HEIGHT) {
-            cout << "err" << endl;
+        if (x > grid.getWidth() || y > grid.getHeight()) {
+            say() << "err" << endl;
             return false;
         }
         return true;
     }
 
-    void addCircle(int x, int y, double r, string& color, string& fillMode) {
-        if (!isOccupied(x, y, "circle", r)) {
+    void addCircle(int x, int y, double r, ShapeStyle style) {
+        if (!isOccupied({ ShapeKind::Circle, x, y, r, 0 })) {
             if (isInBounds(x, y) || isInBounds(x - r, y) || isInBounds(x + r, y) || isInBounds(x, y - r) || isInBounds(x, y + r)) {
-                shapes[nextID] = std::make_unique<Circle>(nextID++, x, y, r, color, fillMode);
+                addShape(Circle{ x, y, r }, style);
             }
             else {
-                cout << "Error: Circle cannot be placed outside the board.\n";
+                fail() << "Error: Circle cannot be placed outside the board.\n";
             }
         }
         else {
-            cout << "Error: Circle already has been placed.\n";
+            fail() << "Error: Circle already has been placed.\n";
         }
 
     }
 
-    void addSquare(int x, int y, double s, string color, string fillMode) {
-        if (!isOccupied(x, y, "square", s)) {
+    void addSquare(int x, int y, double s, ShapeStyle style) {
+        if (!isOccupied({ ShapeKind::Square, x, y, s, 0 })) {
             if (isInBounds(x, y) || isInBounds(x + s - 1, y) || isInBounds(x, y + s - 1)) {
-                shapes[nextID] = std::make_unique<Square>(nextID++, x, y, s, color, fillMode);
+                addShape(Square{ x, y, s }, style);
             }
             else {
-                cout << "Error: Square cannot be placed outside the board.\n";
+                fail() << "Error: Square cannot be placed outside the board.\n";
             }
         }
         else {
-            cout << "Error: Square already has been placed.\n";
+            fail() << "Error: Square already has been placed.\n";
         }
 
     }
 
-    void addTriangle(int x, int y, double h, string color, string fillMode) {
+    void addTriangle(int x, int y, double h, ShapeStyle style) {
         double b = 2 * h;
-        if (!isOccupied(x, y, "triangle", h)) {
+        if (!isOccupied({ ShapeKind::Triangle, x, y, h, 0 })) {
             int startX = static_cast<int>(x);
             int startY = static_cast<int>(y);
             if (isInBounds(x, y) || isInBounds(x - b / 2, y + h - 1) || isInBounds(x + b / 2, y + h - 1) || isInBounds(x, y + h)) {
-                shapes[nextID] = std::make_unique<Triangle>(nextID++, x, y, h, color, fillMode);
+                addShape(Triangle{ x, y, h }, style);
             }
             else {
-                cout << "Error: Triangle cannot be placed outside the board.\n";
+                fail() << "Error: Triangle cannot be placed outside the board.\n";
             }
         }
         else {
-            cout << "Error: Triangle already has been placed.\n";
+            fail() << "Error: Triangle already has been placed.\n";
         }
 
     }
 
-    void addLine(int x1, int y1, int x2, int y2, string color, string fillMode) {
+    void addLine(int x1, int y1, int x2, int y2, ShapeStyle style) {
         // Перевіряємо, чи лінія може бути розміщена на цих координатах
-        if (!isOccupied(x1, y1, "line", x2, y2)) {
+        if (!isOccupied({ ShapeKind::Line, x1, y1, static_cast<double>(x2), static_cast<double>(y2) })) {
             // Перевіряємо, чи координати початку і кінця лінії в межах дошки
             if (isInBounds(x1, y1) || isInBounds(x2, y2)) {
                 // Якщо все добре, додаємо лінію на дошку
-                shapes[nextID] = std::make_unique<Line>(nextID++, x1, y1, x2, y2, color, fillMode);
+                addShape(Line{ x1, y1, x2, y2 }, style);
             }
             else {
-                cout << "Error: Line cannot be placed outside the board.\n";
+                fail() << "Error: Line cannot be placed outside the board.\n";
             }
         }
         else {
-            cout << "Error: Line already exists at these coordinates.\n";
+            fail() << "Error: Line already exists at these coordinates.\n";
         }
     }
 
-    void addRectangle(int x, int y, double width, double height, string color, string fillMode) {
+    void addRectangle(int x, int y, double width, double height, ShapeStyle style) {
         // Перевіряємо, чи місце для прямокутника вільне
-        if (!isOccupied(x, y, "rectangle", width, height)) {
+        if (!isOccupied({ ShapeKind::Rectangle, x, y, width, height })) {
             // Перевіряємо, чи прямокутник не виходить за межі дошки
             if (isInBounds(x, y) || isInBounds(x + width - 1, y + height - 1)) {
                 // Якщо всі умови виконані, додаємо новий прямокутник
-                shapes[nextID] = std::make_unique<Rectangle>(nextID++, x, y, width, height, color, fillMode);
+                addShape(Rectangle{ x, y, width, height }, style);
             }
             else {
-                cout << "Error: Rectangle cannot be placed outside the board.\n";
+                fail() << "Error: Rectangle cannot be placed outside the board.\n";
             }
         }
         else {
-            cout << "Error: Rectangle already exists at this location.\n";
+            fail() << "Error: Rectangle already exists at this location.\n";
         }
     }
 
 
+    // Reverts the last command's changes; each entry is applied in O(1).
     void undo() {
-        if (!shapes.empty()) {
-            auto lastElement = --shapes.end(); // Отримуємо ітератор на останній елемент
-            shapes.erase(lastElement);
+        size_t first;
+        if (!journal.undoRange(first)) {
+            fail() << "Nothing to undo.\n";
+            return;
         }
-        else {
-            cout << "No shapes to undo.\n";
+        for (size_t i = journal.position(); i-- > first;) {
+            apply(journal.at(i), false);
         }
+        journal.undoneTo(first);
+    }
+    void redo() {
+        size_t last;
+        if (!journal.redoRange(last)) {
+            fail() << "Nothing to redo.\n";
+            return;
+        }
+        for (size_t i = journal.position(); i < last; ++i) {
+            apply(journal.at(i), true);
+        }
+        journal.redoneTo(last);
     }
 
     void clear() {
-        shapes.clear();
-        cout << "Board cleared.\n";
+        // The journal keeps the old shapes, so the whole clear can be undone
+        shared_ptr<BoardSnapshot> empty(new BoardSnapshot());
+        empty->nextID = nextID;
+        empty->width = grid.getWidth();
+        empty->height = grid.getHeight();
+        resetShapes(empty);
+        say() << "Board cleared.\n";
+    }
+
+    void printStats() {
+#if SHAPES_STATS
+        perfCounters().print(say());
+#else
+        say() << "Performance counters are not built in.\n";
+#endif
+    }
+    void exportStats(const string& filename) {
+        ofstream file(filename);
+        if (!file) {
+            failFile() << "Error: Could not open file for writing.\n";
+            return;
+        }
+        perfCounters().writeJson(file);
+        say() << "Statistics exported to " << filename << ".\n";
+    }
+    void resetStats() {
+        perfCounters().reset();
+        say() << "Statistics reset.\n";
+    }
+
+    // Saves to filename in the background after the given number of
+    // changes, or after the given number of seconds if anything changed.
+    void startAutosave(const string& filename, int changes, int seconds) {
+        if (changes <= 0 || seconds <= 0) {
+            fail() << "Error: autosave intervals must be positive.\n";
+            return;
+        }
+        autosaver.discard();
+        autosavePath = filename;
+        autosaveChanges = changes;
+        autosaveSeconds = seconds;
+        autosavedAt = journal.changeCount();
+        lastAutosave = chrono::steady_clock::now();
+        autosaveQueuedAt = autosavedAt;
+        autosaveDue = chrono::steady_clock::time_point::max();
+        say() << "Autosaving to " << filename << " every " << changes << " changes or " << seconds << " seconds.\n";
+    }
+    void stopAutosave() {
+        autosaver.discard();
+        autosavePath.clear();
+        say() << "Autosave off.\n";
+    }
+    // Called after every command: reports failed autosaves and hands the
+    // autosaver the board as it is now. The snapshot is written at once when
+    // enough changes have piled up, else when the interval since the last
+    // save runs out, whether or not more commands come. Never waits for a
+    // write.
+    void checkpoint() {
+        journal.finishCommand();
+        for (const string& path : autosaver.collect()) {
+            failFile() << "Error: Autosave to " << path << " failed.\n";
+        }
+        uint64_t changes = journal.changeCount();
+        if (autosavePath.empty() || changes == autosaveQueuedAt) {
+            return;
+        }
+        auto now = chrono::steady_clock::now();
+        if (now >= autosaveDue) {
+            // The worker has written the snapshot that waited for the timer
+            autosavedAt = autosaveQueuedAt;
+            lastAutosave = autosaveDue;
+        }
+        auto due = lastAutosave + chrono::seconds(autosaveSeconds);
+        if (changes - autosavedAt >= static_cast<uint64_t>(autosaveChanges) || now >= due) {
+            autosaver.submit(snapshot(), autosavePath, now);
+            autosavedAt = changes;
+            lastAutosave = now;
+            autosaveDue = chrono::steady_clock::time_point::max();
+        }
+        else {
+            autosaver.submit(snapshot(), autosavePath, due);
+            autosaveDue = due;
+        }
+        autosaveQueuedAt = changes;
+    }
+
+    // Starts appending every change to a log; with the snapshot last saved
+    // while it was open, 'replay' can rebuild the board after a crash.
+    void startJournal(const string& filename) {
+        if (!journal.openLog(filename)) {
+            failFile() << "Error: Could not open " << filename << " as a journal.\n";
+            return;
+        }
+        say() << "Journaling changes to " << filename << ".\n";
+    }
+    void stopJournal() {
+        journal.closeLog();
+        say() << "Journal closed.\n";
+    }
+    // Applies the changes in a log to the board as it is now, normally right
+    // after loading the last snapshot. Stops at the first record that is
+    // damaged or does not fit the board. Nothing is written to an open log.
+    void replay(const string& filename) {
+        MappedFile file(filename);
+        if (!file.isOpen()) {
+            failFile() << "Error: Could not open file for reading.\n";
+            return;
+        }
+        ByteReader r(file.data(), file.size());
+        const char* magic = r.bytes(sizeof(JOURNAL_MAGIC));
+        uint16_t version = r.u16();
+        r.u16();
+        if (!magic || memcmp(magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || version < 1 || version > JOURNAL_VERSION) {
+            failFile() << "Error: " << filename << " is not a board journal.\n";
+            return;
+        }
+
+        bool logging = journal.isLogging();
+        string logPath = journal.getLogPath();
+        journal.closeLog();
+        int replayed = 0;
+        uint32_t loggedGroup = 0;
+        bool complete = true;
+        JournalEntry entry;
+        while (r.remaining() > 0) {
+            if (!Journal::decode(r, entry)) {
+                complete = false;
+                break;
+            }
+            if (entry.op == JournalOp::Reset) {
+                entry.boardBefore = snapshot(); // So the reset can be undone
+            }
+            if (apply(entry, true)) {
+                journal.restore(entry, entry.group != loggedGroup);
+                loggedGroup = entry.group;
+            }
+            else {
+                complete = false;
+                break;
+            }
+            ++replayed;
+        }
+        if (logging) {
+            journal.openLog(logPath);
+        }
+        if (!complete) {
+            fail() << "Error: " << filename << " stops at a damaged or mismatched record; " << replayed << " changes replayed.\n";
+            return;
+        }
+        say() << "Replayed " << replayed << " changes from " << filename << ".\n";
+    }
+    // Changes, undos and redos so far; unchanged means the board is too.
+    uint64_t changeCount() const {
+        return journal.changeCount();
     }
+    // Makes this board a read-only copy of a snapshot, sharing its shapes
+    // and index. Nothing is journaled, and the duplicate set stays empty
+    // since a mirror never adds shapes.
+    void mirror(const BoardSnapshot& snapshot) {
+        setSize(snapshot.width, snapshot.height);
+        invalidateAll();
+        shapes = snapshot.shapes;
+        index = snapshot.index;
+        occupied.clear();
+        nextID = snapshot.nextID;
+    }
+
+    // Shares the shape storage with the board; see ShapeStore.
+    unique_ptr<BoardSnapshot> snapshot() const {
+        return unique_ptr<BoardSnapshot>(new BoardSnapshot{ shapes, index,
+            nextID, grid.getWidth(), grid.getHeight(), journal.changeCount() });
+    }
+    // Publishes the board for readers on other threads, unless the current
+    // version is up to date. Called by the command thread only.
+    void publishVersion() {
+        if (versions.hasVersion() && publishedAt == journal.changeCount()) {
+            return;
+        }
+        versions.publish(snapshot());
+        publishedAt = journal.changeCount();
+    }
+    // Readers join(), then read() the latest published version without
+    // blocking the command thread.
+    EpochVersions<BoardSnapshot>& publishedVersions() { return versions; }
+
     void save(const string& filename) {
+        STAT_TIMER(timer, saveNanos);
+        vector<char> buffer;
+        encodeSnapshot(*snapshot(), buffer);
+        STAT_ADD(saves, 1);
+        STAT_ADD(saveBytes, buffer.size());
+        WriteResult result = writeFileAtomically(filename, buffer);
+        if (result == WriteResult::OpenFailed) {
+            failFile() << "Error: Could not open file for writing.\n";
+            return;
+        }
+        if (result == WriteResult::WriteFailed) {
+            failFile() << "Error: Could not write " << filename << ".\n";
+            return;
+        }
+        journal.restartLog(); // The snapshot now holds everything logged so far
+        say() << "Blackboard saved to " << filename << ".\n";
+    }
+
+    void load(const string& filename) {
+        STAT_TIMER(timer, loadNanos);
+        MappedFile file(filename);
+        if (!file.isOpen()) {
+            failFile() << "Error: Could not open file for reading.\n";
+            return;
+        }
+        STAT_ADD(loads, 1);
+        STAT_ADD(loadBytes, file.size());
+        if (file.size() < sizeof(SNAPSHOT_MAGIC) || memcmp(file.data(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+            importText(filename, file.data(), file.size()); // Older boards are plain text
+            return;
+        }
+        if (!loadSnapshot(file.data(), file.size())) {
+            failFile() << "Error: " << filename << " is not a valid board snapshot.\n";
+            return;
+        }
+        say() << "Blackboard loaded from " << filename << ": " << shapes.size() << " shapes.\n";
+    }
+
+    // Decodes a binary snapshot and swaps it in for the board's shapes.
+    // Nothing changes if decoding fails.
+    bool loadSnapshot(const char* data, size_t size) {
+        shared_ptr<BoardSnapshot> loaded(new BoardSnapshot());
+        loaded->width = grid.getWidth();
+        loaded->height = grid.getHeight();
+        if (!decodeSnapshot(data, size, *loaded)) {
+            return false;
+        }
+        // One journal group, so undo goes back to the board before the load
+        journal.beginGroup();
+        resizeBoard(loaded->width, loaded->height);
+        resetShapes(loaded);
+        journal.endGroup();
+        return true;
+    }
+
+    void exportText(const string& filename) {
+        STAT_TIMER(timer, saveNanos);
         ofstream file(filename);
         if (!file) {
-            cerr << "Error: Could not open file for writing.\n";
+            failFile() << "Error: Could not open file for writing.\n";
             return;
         }
         file << shapes.size() << endl;
-        for (const auto& shapePair : shapes) {
-            file << shapePair.second->getLoad() << endl; // Використовуємо shapePair.second для доступу до Shape
-        }
+        file << "Board: " << grid.getWidth() << " " << grid.getHeight() << endl;
+        shapes.forEach([&](int id, const auto& shape, ShapeStyle style) {
+            file << shape.getLoad(id, shapes.colorName(style), shapes.fillName(style)) << endl;
+        });
+        STAT_ADD(saves, 1);
+        STAT_ADD(saveBytes, static_cast<uint64_t>(file.tellp()));
         file.close();
-        cout << "Blackboard saved to " << filename << ".\n";
+        say() << "Blackboard exported to " << filename << ".\n";
     }
 
-    void load(const string& filename) {
-        ifstream file(filename);
+    // Renders the board to a .ppm or .png file, scale pixels per cell.
+    void exportImage(const string& filename, int scale) {
+        STAT_TIMER(timer, saveNanos);
+        ImageFormat format;
+        if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".ppm") == 0) {
+            format = ImageFormat::Ppm;
+        }
+        else if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".png") == 0) {
+            format = ImageFormat::Png;
+        }
+        else {
+            fail() << "Error: Image files must end in .ppm or .png.\n";
+            return;
+        }
+        if (scale < 1 || scale > MAX_IMAGE_SCALE) {
+            fail() << "Error: Scale must be between 1 and " << MAX_IMAGE_SCALE << ".\n";
+            return;
+        }
+        refresh(grid.bounds());
+        ofstream file(filename, ios::binary);
         if (!file) {
-            cerr << "Error: Could not open file for reading.\n";
+            failFile() << "Error: Could not open file for writing.\n";
+            return;
+        }
+        if (!writeImage(grid, scale, format, file)) {
+            failFile() << "Error: The board is too large for an image at scale " << scale << ".\n";
+            return;
+        }
+        STAT_ADD(saves, 1);
+        STAT_ADD(saveBytes, static_cast<uint64_t>(file.tellp()));
+        file.close();
+        if (!file) {
+            failFile() << "Error: Could not write " << filename << ".\n";
+            return;
+        }
+        say() << "Board exported to " << filename << ".\n";
+    }
+
+    void importText(const string& filename) {
+        STAT_TIMER(timer, loadNanos);
+        MappedFile file(filename);
+        if (!file.isOpen()) {
+            failFile() << "Error: Could not open file for reading.\n";
             return;
         }
+        STAT_ADD(loads, 1);
+        STAT_ADD(loadBytes, file.size());
+        importText(filename, file.data(), file.size());
+    }
 
+    // Parses the text format in place, one shape per line; the leading count
+    // line is informational only. An optional "Board: w h" line sets the
+    // board size. Shapes still go through the add* checks.
+    void importText(const string& filename, const char* data, size_t size) {
+        journal.beginGroup();
         clear();
-        int shapeCount;
-        file >> shapeCount;
-        for (int i = 0; i < shapeCount; ++i) {
-            string shapeType;
-            file >> shapeType;
-            if (shapeType == "Circle:") {
-                int id, x, y;
-                double r;
-                string color, fillMode;
-                file >> id >> x >> y >> r >> color >> fillMode;
-                addCircle(x, y, r, color, fillMode);
-            }
-            else if (shapeType == "Square:") {
-                int id, x, y;
-                double  s;
-                string color, fillMode;
-                file >> id >> x >> y >> s >> color >> fillMode ;
-                addSquare(x, y, s, color, fillMode);
-            }
-            else if (shapeType == "Triangle:") {
-                int id, x, y;
-                double  h;
-                string color, fillMode;
-                file >> id >> x >> y >> h >> color >> fillMode;
-                addTriangle(x, y, h, color, fillMode);
+        int skipped = 0;
+        ShapeStyle style;
+        std::string_view text(data, size);
+        bool firstLine = true;
+        while (!text.empty()) {
+            size_t eol = text.find('\n');
+            std::string_view line = text.substr(0, eol);
+            text.remove_prefix(eol == std::string_view::npos ? text.size() : eol + 1);
+
+            TokenCursor tokens(line);
+            std::string_view shapeType, colorToken, fillToken;
+            if (!tokens.next(shapeType)) {
+                continue;
+            }
+            if (firstLine) {
+                firstLine = false;
+                int count;
+                if (TokenCursor(line).nextInt(count)) {
+                    continue;
+                }
+            }
+
+            int id, x, y;
+            bool ok = tokens.nextInt(id);
+            if (shapeType == "Board:") {
+                int height;
+                ok = ok && tokens.nextInt(height) && resizeBoard(id, height); // Board: width height
+            }
+            else if (shapeType == "Circle:" || shapeType == "Square:" || shapeType == "Triangle:") {
+                double param;
+                ok = ok && tokens.nextInt(x) && tokens.nextInt(y) && tokens.nextDouble(param) && tokens.next(colorToken) && tokens.next(fillToken) &&
+                    palette().intern(colorToken, fillToken, style);
+                if (ok) {
+                    if (shapeType == "Circle:") addCircle(x, y, param, style);
+                    else if (shapeType == "Square:") addSquare(x, y, param, style);
+                    else addTriangle(x, y, param, style);
+                }
             }
             else if (shapeType == "Line:") {
-                int id;
-                int x1, y1, x2, y2;
-                string color, fillMode;
-                file >> id >> x1 >> y1 >> x2 >> y2 >> color >> fillMode;
-                addLine(x1, y1, x2, y2, color, fillMode);
+                int x2, y2;
+                ok = ok && tokens.nextInt(x) && tokens.nextInt(y) && tokens.nextInt(x2) && tokens.nextInt(y2) && tokens.next(colorToken) && tokens.next(fillToken) &&
+                    palette().intern(colorToken, fillToken, style);
+                if (ok) {
+                    addLine(x, y, x2, y2, style);
+                }
             }
             else if (shapeType == "Rectangle:") {
-                int id, x, y;
-                double  w, h;
-                string color, fillMode;
-                file >> id >> x >> y >> w >> h >> color >> fillMode;
-                addRectangle(x, y, w, h, color, fillMode);
+                double w, h;
+                ok = ok && tokens.nextInt(x) && tokens.nextInt(y) && tokens.nextDouble(w) && tokens.nextDouble(h) && tokens.next(colorToken) && tokens.next(fillToken) &&
+                    palette().intern(colorToken, fillToken, style);
+                if (ok) {
+                    addRectangle(x, y, w, h, style);
+                }
+            }
+            else {
+                ok = false;
+            }
+            if (!ok) {
+                ++skipped;
             }
         }
-        file.close();
-        cout << "Blackboard loaded from " << filename << ".\n";
+        journal.endGroup();
+        say() << "Blackboard loaded from " << filename << ": " << shapes.size() << " shapes";
+        if (skipped > 0) {
+            say() << ", " << skipped << " unreadable lines skipped";
+        }
+        say() << ".\n";
     }
-    
+
     void select(int id) {
         bool found = false;
-        for (const auto& shapePair : shapes) {
-            cout << shapePair.first << endl;
-            if (shapePair.first==id) { // Assume containsPoint checks if a shape contains the point
-                cout << shapePair.second->getInfo() << endl;
-                lastSelectedId = shapePair.first;
+        for (int shapeId = 0; shapeId <= shapes.lastId() && !found; ++shapeId) {
+            if (!shapes.contains(shapeId)) {
+                continue;
+            }
+            say() << shapeId << endl;
+            if (shapeId == id) {
+                say() << shapes.info(id) << endl;
+                lastSelectedId = id;
                 found = true;
-                break;
             }
         }
         if (!found) {
-            cout << "Shape with ID " << id << " was not found.\n";
+            fail() << "Shape with ID " << id << " was not found.\n";
         }
     }
 
+    // Picks the top-most shape drawn at (x, y). On the board this is a
+    // lookup in the shape-ID buffer, brought up to date first if needed;
+    // points off the board fall back to the spatial index.
     void select(int x, int y) {
-        bool found = false;
-        for (auto it = shapes.rbegin(); it != shapes.rend(); ++it) { 
-            if (it->second->containsPoint(x, y)) {
-                cout << it->second->getInfo() << endl; 
-                lastSelectedId = it->first; 
-                found = true;
-                break;
-            }
+        int found = NO_SHAPE;
+        STAT_ADD(pointPicks, 1);
+        if (grid.bounds().contains(x, y)) {
+            refresh({ x, y, x + 1, y + 1 }); // Only the picked cell has to be current
+            STAT_ADD(bufferPicks, 1);
+            found = grid.shapeAt(x, y);
         }
-        if (!found) {
-            cout << "No shape found at point (" << x << ", " << y << ").\n";
+        else {
+            index.visitPoint(x, y, [&](int id) {
+                if (!shapes.containsPoint(id, x, y)) {
+                    return false;
+                }
+                found = id;
+                return true;
+            });
         }
+        if (found == NO_SHAPE) {
+            fail() << "No shape found at point (" << x << ", " << y << ").\n";
+            return;
+        }
+        say() << shapes.info(found) << endl; 
+        lastSelectedId = found; 
+    }
+
+    // Lists the shapes visible in the area and selects the top-most of them.
+    void select(int x, int y, int width, int height) {
+        Rect area = Rect{ x, y, x + width, y + height }.intersected(grid.bounds());
+        refresh(area);
+        vector<int32_t> found = grid.shapesIn(area);
+        if (found.empty()) {
+            fail() << "No shapes found in area (" << x << ", " << y << ") " << width << "x" << height << ".\n";
+            return;
+        }
+        for (int32_t id : found) {
+            say() << shapes.info(id) << endl;
+        }
+        lastSelectedId = found.back();
     }
 
     int getLastSelectedId() const {
         return lastSelectedId; // Method to get the last selected shape ID
     }
+    void setSelection(int id) {
+        lastSelectedId = id;
+    }
     void remove() {
         if (lastSelectedId == -1) {
-            std::cout << "No shape selected.\n";
+            fail() << "No shape selected.\n";
             return;
         }
-        auto it = shapes.find(lastSelectedId);
-        if (it != shapes.end()) {
-            shapes.erase(it); 
-            cout << "Shape with ID " << lastSelectedId << " removed.\n";
+        if (shapes.contains(lastSelectedId)) {
+            journal.record({ JournalOp::Remove, 0, lastSelectedId, shapes.key(lastSelectedId), {}, shapes.style(lastSelectedId), {}, {}, {} });
+            eraseShape(lastSelectedId);
+            say() << "Shape with ID " << lastSelectedId << " removed.\n";
         }
         else {
-            cout << "Shape with ID " << lastSelectedId << " not found.\n";
+            fail() << "Shape with ID " << lastSelectedId << " not found.\n";
         }
     }
-    void paint(const std::string& color) {
+    void paint(ColorId color) {
         if (lastSelectedId == -1) {
-            std::cout << "No shape selected.\n";
+            fail() << "No shape selected.\n";
             return;
         }
 
-        auto it = shapes.find(lastSelectedId);
-        if (it != shapes.end()) {
-            it->second->setColor(color); // Assuming a method to set color exists in your shape class
-            std::cout << lastSelectedId << " " << it->second->getShape() << " " << color << std::endl; // Output new color info
+        if (shapes.contains(lastSelectedId)) {
+            ShapeStyle before = shapes.style(lastSelectedId);
+            ShapeStyle after = { color, before.fill };
+            restyle(lastSelectedId, after);
+            if (before.color != color) {
+                journal.record({ JournalOp::Paint, 0, lastSelectedId, {}, {}, before, after, {}, {} });
+            }
+            say() << lastSelectedId << " " << shapeName(shapes.kindOf(lastSelectedId)) << " " << palette().colorName(color) << std::endl; // Output new color info
         }
         else {
-            std::cout << "Shape with ID " << lastSelectedId << " not found.\n";
+            fail() << "Shape with ID " << lastSelectedId << " not found.\n";
         }
     }
     void move(int newX, int newY) {
         if (lastSelectedId == -1) {
-            std::cout << "No shape selected.\n";
+            fail() << "No shape selected.\n";
             return;
         }
 
-        auto it = shapes.find(lastSelectedId);
-        if (it != shapes.end()) {
-            Shapes* shape = it->second.get();
-
-            if (newX < 0 || newX >= BOARD_WIDTH || newY < 0 || newY >= BOARD_HEIGHT) {
-                std::cout << "Error: shape will go out of the board.\n";
+        if (shapes.contains(lastSelectedId)) {
+            if (newX < 0 || newX >= grid.getWidth() || newY < 0 || newY >= grid.getHeight()) {
+                fail() << "Error: shape will go out of the board.\n";
                 return;
             }
 
-            shape->setX(newX); 
-            shape->setY(newY); 
-
-            lastSelectedId = lastSelectedId; 
+            GeometryKey before = shapes.key(lastSelectedId);
+            unlink(lastSelectedId);
+            switch (shapes.kindOf(lastSelectedId)) {
+            case ShapeKind::Triangle: shapes.get<Triangle>(lastSelectedId).moveTo(newX, newY); break;
+            case ShapeKind::Circle: shapes.get<Circle>(lastSelectedId).moveTo(newX, newY); break;
+            case ShapeKind::Square: shapes.get<Square>(lastSelectedId).moveTo(newX, newY); break;
+            case ShapeKind::Rectangle: shapes.get<Rectangle>(lastSelectedId).moveTo(newX, newY); break;
+            case ShapeKind::Line: shapes.get<Line>(lastSelectedId).moveTo(newX, newY); break;
+            }
+            link(lastSelectedId);
+            recordChange(lastSelectedId, before);
 
-            std::cout << lastSelectedId << " " << shape->getShape() << " moved.\n"; 
+            say() << lastSelectedId << " " << shapeName(shapes.kindOf(lastSelectedId)) << " moved.\n"; 
         }
         else {
-            std::cout << "Shape with ID " << lastSelectedId << " not found.\n";
+            fail() << "Shape with ID " << lastSelectedId << " not found.\n";
         }
     }
     void edit(int param1, int param2) {
         if (lastSelectedId == -1) {
-            cout << "Error: No shape selected." << endl;
+            fail() << "Error: No shape selected." << endl;
             return;
         }
-        auto it = shapes.find(lastSelectedId);
-        if (it != shapes.end()) {
-            Shapes* shape = it->second.get(); // Get the selected shape
-            if (auto* rectangle = dynamic_cast<Rectangle*>(shape)) {
-                rectangle->setDimensions(param1, param2);
-                cout << "Size of rectangle changed." << endl;
+        if (shapes.contains(lastSelectedId)) {
+            if (shapes.kindOf(lastSelectedId) == ShapeKind::Rectangle) {
+                GeometryKey before = shapes.key(lastSelectedId);
+                unlink(lastSelectedId);
+                if (!shapes.get<Rectangle>(lastSelectedId).setDimensions(param1, param2, boardArea())) {
+                    fail() << "error: shape will go out of the board" << endl;
+                }
+                link(lastSelectedId);
+                recordChange(lastSelectedId, before);
+                say() << "Size of rectangle changed." << endl;
             }
             else {
-                cout << "error invalid type" << endl;
+                fail() << "error invalid type" << endl;
             }
         }
         else {
-            cout << "Error: Shape with ID " << lastSelectedId << " not found." << endl;
+            fail() << "Error: Shape with ID " << lastSelectedId << " not found." << endl;
         }
     }
     void edit(int param1) {
         // Check if a shape is selected
         if (lastSelectedId == -1) {
-            cout << "Error: No shape selected." << endl;
+            fail() << "Error: No shape selected." << endl;
             return;
         }
 
         // Find the selected shape by ID
-        auto it = shapes.find(lastSelectedId);
-        if (it != shapes.end()) {
-            Shapes* shape = it->second.get(); // Get the selected shape
+        if (shapes.contains(lastSelectedId)) {
+            ShapeKind kind = shapes.kindOf(lastSelectedId);
 
-            if (auto* circle = dynamic_cast<Circle*>(shape)) {
-                circle->setDimensions(param1);
-                cout << "Radius of circle changed." << endl;
+            if (kind == ShapeKind::Circle) {
+                GeometryKey before = shapes.key(lastSelectedId);
+                unlink(lastSelectedId);
+                if (!shapes.get<Circle>(lastSelectedId).setDimensions(param1, boardArea())) {
+                    fail() << "error: shape will go out of the board" << endl;
+                }
+                link(lastSelectedId);
+                recordChange(lastSelectedId, before);
+                say() << "Radius of circle changed." << endl;
             }
-            else if (auto* triangle = dynamic_cast<Triangle*>(shape)) {
-                triangle->setDimensions(param1);
+            else if (kind == ShapeKind::Triangle) {
+                GeometryKey before = shapes.key(lastSelectedId);
+                unlink(lastSelectedId);
+                if (!shapes.get<Triangle>(lastSelectedId).setDimensions(param1, boardArea())) {
+                    fail() << "error: shape will go out of the board" << endl;
+                }
+                link(lastSelectedId);
+                recordChange(lastSelectedId, before);
                 
-                cout << "Size of triangle changed." << endl;
+                say() << "Size of triangle changed." << endl;
             }
-            else if (auto* square = dynamic_cast<Square*>(shape)) {
-                square->setDimensions(param1);
-                cout << "Size of square changed." << endl;
+            else if (kind == ShapeKind::Square) {
+                GeometryKey before = shapes.key(lastSelectedId);
+                unlink(lastSelectedId);
+                if (!shapes.get<Square>(lastSelectedId).setDimensions(param1, boardArea())) {
+                    fail() << "error: shape will go out of the board" << endl;
+                }
+                link(lastSelectedId);
+                recordChange(lastSelectedId, before);
+                say() << "Size of square changed." << endl;
             }       
         }
         else {
-            cout << "Error: Shape with ID " << lastSelectedId << " not found." << endl;
+            fail() << "Error: Shape with ID " << lastSelectedId << " not found." << endl;
         }
     }
     void edit(int param1, int param2, int param3, int param4) {
         if (lastSelectedId == -1) {
-            cout << "Error: No shape selected." << endl;
+            fail() << "Error: No shape selected." << endl;
             return;
         }
-        auto it = shapes.find(lastSelectedId);
-        if (it != shapes.end()) {
-            Shapes* shape = it->second.get(); // Get the selected shape
-            if (auto* line = dynamic_cast<Line*>(shape)) {
-                line->setDimensions(param1, param2, param3, param4);
-                cout << "Size of rectangle changed." << endl;
+        if (shapes.contains(lastSelectedId)) {
+            if (shapes.kindOf(lastSelectedId) == ShapeKind::Line) {
+                GeometryKey before = shapes.key(lastSelectedId);
+                unlink(lastSelectedId);
+                shapes.get<Line>(lastSelectedId).setDimensions(param1, param2, param3, param4);
+                link(lastSelectedId);
+                recordChange(lastSelectedId, before);
+                say() << "Size of rectangle changed." << endl;
             }
         }
         else {
-            cout << "Error: Shape with ID " << lastSelectedId << " not found." << endl;
+            fail() << "Error: Shape with ID " << lastSelectedId << " not found." << endl;
+        }
+    }
+};
+
+// Multi-producer, single-consumer queue (Vyukov's linked list): a push is
+// one atomic exchange plus a store and never waits on other threads. Only
+// one thread may pop or wait. A consumer that finds the queue empty can
+// sleep in wait(); pushes ring it awake only while it is asleep.
+template <typename T>
+class MpscQueue {
+private:
+    struct Node {
+        atomic<Node*> next;
+        T value;
+    };
+    atomic<Node*> head;  // Newest node; producers swap themselves in here
+    Node* tail;          // Consumer side: the node before the oldest value
+    atomic<bool> sleeping;
+    mutex lock;          // Only for putting the consumer to sleep
+    condition_variable bell;
+    bool rung;
+public:
+    MpscQueue() : sleeping(false), rung(false) {
+        Node* stub = new Node();
+        stub->next = nullptr;
+        head = stub;
+        tail = stub;
+    }
+    ~MpscQueue() {
+        T value;
+        while (pop(value)) {}
+        delete tail;
+    }
+
+    void push(T value) {
+        Node* node = new Node();
+        node->next.store(nullptr, memory_order_relaxed);
+        node->value = std::move(value);
+        Node* previous = head.exchange(node, memory_order_acq_rel);
+        previous->next.store(node); // seq_cst, ordered against the check of sleeping
+        if (sleeping.load()) {
+            lock_guard<mutex> guard(lock);
+            rung = true;
+            bell.notify_one();
+        }
+    }
+    // False if the queue is empty. A push still in progress shows up once
+    // it completes.
+    bool pop(T& value) {
+        Node* next = tail->next.load(memory_order_acquire);
+        if (!next) {
+            return false;
         }
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+    // Sleeps until something is pushed or the timeout passes.
+    template <typename Duration>
+    void wait(Duration timeout) {
+        sleeping.store(true);
+        if (tail->next.load() == nullptr) {
+            unique_lock<mutex> guard(lock);
+            bell.wait_for(guard, timeout, [this] { return rung; });
+            rung = false;
+        }
+        sleeping.store(false);
     }
 };
 
+#ifndef _WIN32
+// Set by SIGINT or SIGTERM to stop a running server.
+atomic<bool> serverStopRequested(false);
+
+void requestServerStop(int) {
+    serverStopRequested = true;
+}
+#endif
+
 class CommandLine {
 private:
+    // A command handler reads its arguments from the rest of the line. It
+    // returns false if they are malformed, optionally after setting problem.
+    typedef bool (CommandLine::*Handler)(TokenCursor& args);
+
+    enum class Outcome {
+        Skipped, // Blank line or comment
+        Done,
+        Failed,  // Malformed, or the board reported an error
+        Stop     // 'exit'
+    };
+
     Board board;
-    int lastSelectedId;  
-    bool shapeSelected;
-public:
-    CommandLine() : lastSelectedId(-1), shapeSelected(false) {}
+    ostream* messages;       // Prompts and parse errors; quiet in batch mode
+    ostream* frames;         // Where 'draw' prints the board
+    bool batch;
+    bool serving;            // Commands come from server clients
+    bool drawPending;        // Batch mode: a 'draw' is waiting for the next flush
+    bool stopRequested;
+    const char* problem;     // Why the current command is malformed, if known
 
-    void run() {
-        string command;
-        while (true) {
-            
-            cout << "> ";
-            cin >> command;
-
-            if (command == "draw") {
-                board.draw(); 
-                board.print(); 
-            }
-            else if (command == "list") {
-                board.list();
-            }
-            else if (command == "shapes") {
-                cout << "> Triangle coordinates base height" << endl;
-                cout << "> Circle coordinates radius" << endl;
-                cout << "> Square coordinates side" << endl;
-                cout << "> Rectangle coordinates width height" << endl;
-                cout << "> Line x1 y1 x2 y2" << endl;
-            }
-            else if (command == "add") {
-                string shapeType, color, fillMode;
-                cin >> fillMode >> color >> shapeType;
-
-                if (shapeType == "circle") {
-                    double r;
-                    int x, y;
-                    cin >> x >> y >> r;
-                    board.addCircle(x, y, r, color, fillMode);
-                }
-                else if (shapeType == "square") {
-                    double s;
-                    int x, y;
-                    cin >> x >> y >> s;
-                    board.addSquare(x, y, s, color, fillMode);
-                }
-                else if (shapeType == "line") {
-                    int x1, y1, x2, y2;
-                    cin >> x1 >> y1 >> x2 >> y2;
-                    board.addLine(x1, y1, x2, y2, color, fillMode);
-                }
-                else if (shapeType == "rectangle") {
-                    double w, h;
-                    int x, y;
-                    cin >> x >> y >> w >> h;
-                    board.addRectangle(x, y, w, h, color, fillMode);
-                }
-                else if (shapeType == "triangle") {
-                    double h;
-                    int x, y;
-                    cin >> x >> y >> h;
-                    board.addTriangle(x, y, h, color, fillMode);
-                }
+    static const size_t MAX_REPORTED_LINES = 20;
+
+    static Handler find(std::string_view name) {
+        static const struct {
+            std::string_view name;
+            Handler handler;
+        } table[] = {
+            { "add", &CommandLine::addCommand },
+            { "select", &CommandLine::selectCommand },
+            { "draw", &CommandLine::drawCommand },
+            { "move", &CommandLine::moveCommand },
+            { "paint", &CommandLine::paintCommand },
+            { "edit", &CommandLine::editCommand },
+            { "remove", &CommandLine::removeCommand },
+            { "undo", &CommandLine::undoCommand },
+            { "redo", &CommandLine::redoCommand },
+            { "list", &CommandLine::listCommand },
+            { "flush", &CommandLine::flushCommand },
+            { "clear", &CommandLine::clearCommand },
+            { "shapes", &CommandLine::shapesCommand },
+            { "save", &CommandLine::saveCommand },
+            { "load", &CommandLine::loadCommand },
+            { "export", &CommandLine::exportCommand },
+            { "image", &CommandLine::imageCommand },
+            { "import", &CommandLine::importCommand },
+            { "resize", &CommandLine::resizeCommand },
+            { "live", &CommandLine::liveCommand },
+            { "threads", &CommandLine::threadsCommand },
+            { "view", &CommandLine::viewCommand },
+            { "journal", &CommandLine::journalCommand },
+            { "replay", &CommandLine::replayCommand },
+            { "autosave", &CommandLine::autosaveCommand },
+            { "stats", &CommandLine::statsCommand },
+            { "batch", &CommandLine::batchCommand },
+            { "exit", &CommandLine::exitCommand },
+        };
+        for (const auto& entry : table) {
+            if (entry.name == name) {
+                return entry.handler;
+            }
+        }
+        return nullptr;
+    }
+
+    ostream& say() { return *messages; }
+    bool malformed(const char* why) {
+        problem = why;
+        return false;
+    }
+    // Splits the rest of a line into at most max tokens and returns how
+    // many there were; max + 1 means the line had too many.
+    static int splitRest(TokenCursor& tokens, std::string_view* out, int max) {
+        int count = 0;
+        std::string_view token;
+        while (count <= max && tokens.next(token)) {
+            if (count < max) {
+                out[count] = token;
+            }
+            ++count;
+        }
+        return count;
+    }
+    static bool toInt(std::string_view token, int& value) {
+        return TokenCursor(token).nextInt(value);
+    }
+    static bool toDouble(std::string_view token, double& value) {
+        return TokenCursor(token).nextDouble(value);
+    }
+    static bool nextPath(TokenCursor& args, string& path) {
+        std::string_view token;
+        if (!args.next(token)) {
+            return false;
+        }
+        path.assign(token);
+        return true;
+    }
+
+    // Runs one line of input; its tokens point into the line.
+    Outcome execute(std::string_view line) {
+        TokenCursor tokens(line);
+        std::string_view command;
+        if (!tokens.next(command) || command[0] == '#') {
+            return Outcome::Skipped;
+        }
+        Handler handler = find(command);
+        if (!handler) {
+            say() << "Unknown command.\n";
+            return Outcome::Failed;
+        }
+        problem = nullptr;
+        int failuresBefore = board.getFailures();
+        if (!(this->*handler)(tokens)) {
+            if (problem) {
+                say() << problem << "\n";
             }
-            else if (command == "undo") {
-                board.undo();
+            else {
+                say() << "Invalid arguments for " << command << ".\n";
             }
-            else if (command == "clear") {
-                board.clear();
+            return Outcome::Failed;
+        }
+        Outcome outcome = board.getFailures() == failuresBefore ? Outcome::Done : Outcome::Failed;
+        board.checkpoint();
+        return stopRequested ? Outcome::Stop : outcome;
+    }
+
+    bool addCommand(TokenCursor& args) {
+        std::string_view fillMode, color, shapeType;
+        ShapeStyle style;
+        if (!args.next(fillMode) || !args.next(color) || !args.next(shapeType)) {
+            return false;
+        }
+        if (!palette().intern(color, fillMode, style)) {
+            return malformed("Error: too many distinct colors or fill modes.");
+        }
+        int x, y, x2, y2;
+        double size, height;
+        if (!args.nextInt(x) || !args.nextInt(y)) {
+            return false;
+        }
+        if (shapeType == "circle" && args.nextDouble(size)) {
+            board.addCircle(x, y, size, style);
+        }
+        else if (shapeType == "square" && args.nextDouble(size)) {
+            board.addSquare(x, y, size, style);
+        }
+        else if (shapeType == "triangle" && args.nextDouble(size)) {
+            board.addTriangle(x, y, size, style);
+        }
+        else if (shapeType == "rectangle" && args.nextDouble(size) && args.nextDouble(height)) {
+            board.addRectangle(x, y, size, height, style);
+        }
+        else if (shapeType == "line" && args.nextInt(x2) && args.nextInt(y2)) {
+            board.addLine(x, y, x2, y2, style);
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+    bool selectCommand(TokenCursor& args) {
+        std::string_view params[4];
+        int x, y, w, h;
+        switch (splitRest(args, params, 4)) {
+        case 1:
+            if (!toInt(params[0], x)) {
+                return malformed("Invalid ID.");
             }
-            else if (command == "save") {
-                string filepath;
-                cin >> filepath;
-                board.save(filepath);
+            board.select(x);
+            return true;
+        case 2:
+            if (!toInt(params[0], x) || !toInt(params[1], y)) {
+                return malformed("Invalid coordinates.");
             }
-            else if (command == "load") {
-                string filepath;
-                cin >> filepath;
-                board.load(filepath);
+            board.select(x, y);
+            return true;
+        case 4:
+            if (!toInt(params[0], x) || !toInt(params[1], y) || !toInt(params[2], w) || !toInt(params[3], h)) {
+                return malformed("Invalid area.");
             }
-            else if (command == "exit") {
-          
-                break;
+            board.select(x, y, w, h);
+            return true;
+        }
+        return malformed("Invalid selection parameters.");
+    }
+    void printBoard() {
+        board.draw();
+        board.print(*frames);
+        drawPending = false;
+    }
+    bool drawCommand(TokenCursor&) {
+        if (batch) {
+            drawPending = true; // Printed once, at the end or at the next flush
+        }
+        else {
+            printBoard();
+        }
+        return true;
+    }
+    bool flushCommand(TokenCursor&) {
+        printBoard();
+        return true;
+    }
+    bool moveCommand(TokenCursor& args) {
+        int newX, newY;
+        if (!args.nextInt(newX) || !args.nextInt(newY)) {
+            return false;
+        }
+        if (board.getLastSelectedId() == -1) {
+            return malformed("No shape selected.");
+        }
+        board.move(newX, newY);
+        return true;
+    }
+    bool paintCommand(TokenCursor& args) {
+        std::string_view newColor;
+        ColorId color;
+        if (!args.next(newColor)) {
+            return false;
+        }
+        if (!palette().internColor(newColor, color)) {
+            return malformed("Error: too many distinct colors.");
+        }
+        board.paint(color);
+        return true;
+    }
+    bool editCommand(TokenCursor& args) {
+        std::string_view params[4];
+        double values[4];
+        int count = splitRest(args, params, 4);
+        if (count != 1 && count != 2 && count != 4) {
+            return malformed("Invalid edit parameters.");
+        }
+        for (int i = 0; i < count; ++i) {
+            if (!toDouble(params[i], values[i])) {
+                return malformed("Invalid number.");
             }
-            else if (command == "select") {
-                string selection;
-                getline(cin, selection); 
+        }
+        if (count == 1) board.edit(values[0]);
+        else if (count == 2) board.edit(values[0], values[1]);
+        else board.edit(values[0], values[1], values[2], values[3]);
+        return true;
+    }
+    bool removeCommand(TokenCursor&) {
+        if (board.getLastSelectedId() == -1) {
+            return malformed("No shape selected to remove.");
+        }
+        board.remove();
+        return true;
+    }
+    bool undoCommand(TokenCursor&) {
+        board.undo();
+        return true;
+    }
+    bool redoCommand(TokenCursor&) {
+        board.redo();
+        return true;
+    }
+    bool listCommand(TokenCursor&) {
+        board.list();
+        return true;
+    }
+    bool clearCommand(TokenCursor&) {
+        board.clear();
+        return true;
+    }
+    bool shapesCommand(TokenCursor&) {
+        say() << "> Triangle coordinates base height" << endl;
+        say() << "> Circle coordinates radius" << endl;
+        say() << "> Square coordinates side" << endl;
+        say() << "> Rectangle coordinates width height" << endl;
+        say() << "> Line x1 y1 x2 y2" << endl;
+        return true;
+    }
+    bool saveCommand(TokenCursor& args) {
+        if (!nextPath(args, path)) {
+            return false;
+        }
+        board.save(path);
+        return true;
+    }
+    bool loadCommand(TokenCursor& args) {
+        if (!nextPath(args, path)) {
+            return false;
+        }
+        board.load(path);
+        return true;
+    }
+    bool exportCommand(TokenCursor& args) {
+        if (!nextPath(args, path)) {
+            return false;
+        }
+        board.exportText(path);
+        return true;
+    }
+    // image <file> [scale]: PPM or PNG by the file's extension.
+    bool imageCommand(TokenCursor& args) {
+        if (!nextPath(args, path)) {
+            return false;
+        }
+        int scale = 4;
+        args.nextInt(scale);
+        board.exportImage(path, scale);
+        return true;
+    }
+    bool importCommand(TokenCursor& args) {
+        if (!nextPath(args, path)) {
+            return false;
+        }
+        board.importText(path);
+        return true;
+    }
+    // journal <file> starts logging changes to file; journal off stops.
+    bool journalCommand(TokenCursor& args) {
+        if (!nextPath(args, path)) {
+            return false;
+        }
+        if (path == "off") {
+            board.stopJournal();
+        }
+        else {
+            board.startJournal(path);
+        }
+        return true;
+    }
+    bool replayCommand(TokenCursor& args) {
+        if (!nextPath(args, path)) {
+            return false;
+        }
+        board.replay(path);
+        return true;
+    }
+    // autosave <file> [changes [seconds]] or autosave off
+    bool autosaveCommand(TokenCursor& args) {
+        if (!nextPath(args, path)) {
+            return false;
+        }
+        if (path == "off") {
+            board.stopAutosave();
+            return true;
+        }
+        int changes = 100, seconds = 60;
+        if (args.nextInt(changes)) {
+            args.nextInt(seconds);
+        }
+        board.startAutosave(path, changes, seconds);
+        return true;
+    }
+    // stats prints the performance counters; stats json <file> writes
+    // them as JSON and stats reset zeroes them.
+    bool statsCommand(TokenCursor& args) {
+        std::string_view action;
+        if (!args.next(action)) {
+            board.printStats();
+        }
+        else if (action == "reset") {
+            board.resetStats();
+        }
+        else if (action == "json" && nextPath(args, path)) {
+            board.exportStats(path);
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+    bool resizeCommand(TokenCursor& args) {
+        int width, height;
+        if (!args.nextInt(width) || !args.nextInt(height)) {
+            return false;
+        }
+        board.resize(width, height);
+        return true;
+    }
+    bool liveCommand(TokenCursor& args) {
+        if (serving) {
+            return malformed("Error: live mode is not available to server clients.");
+        }
+        std::string_view mode;
+        if (!args.next(mode)) {
+            return false;
+        }
+        board.setLiveMode(mode == "on");
+        return true;
+    }
+    // view x y w h [zoom] prints only that part of the board; view off
+    // prints all of it again.
+    bool viewCommand(TokenCursor& args) {
+        TokenCursor probe = args;
+        std::string_view word;
+        if (probe.next(word) && word == "off") {
+            board.clearView();
+            return true;
+        }
+        int x, y, width, height, zoom = 1;
+        if (!args.nextInt(x) || !args.nextInt(y) || !args.nextInt(width) || !args.nextInt(height)) {
+            return false;
+        }
+        args.nextInt(zoom);
+        board.setView(x, y, width, height, zoom);
+        return true;
+    }
+    bool threadsCommand(TokenCursor& args) {
+        int count;
+        if (!args.nextInt(count)) {
+            return false;
+        }
+        board.setRenderThreads(count);
+        return true;
+    }
+    bool batchCommand(TokenCursor& args) {
+        if (batch) {
+            return malformed("Error: batch scripts cannot be nested.");
+        }
+        if (serving) {
+            return malformed("Error: server clients cannot run batch scripts.");
+        }
+        string script;
+        if (!nextPath(args, script)) {
+            return false;
+        }
+        runBatch(script);
+        return true;
+    }
+    bool exitCommand(TokenCursor&) {
+        stopRequested = true;
+        return true;
+    }
 
-                stringstream ss(selection);
-                vector<string> params;
-                string param;
-                while (ss >> param) {
-                    params.push_back(param);
-                }
+    // Batch mode bookkeeping around execute()
+    struct BatchResult {
+        int commands = 0;
+        vector<int> failedLines;
+    };
+    void runBatchLine(std::string_view line, int lineNumber, BatchResult& result) {
+        Outcome outcome = execute(line);
+        if (outcome == Outcome::Skipped) {
+            return;
+        }
+        ++result.commands;
+        if (outcome == Outcome::Failed) {
+            result.failedLines.push_back(lineNumber);
+        }
+    }
 
-                if (params.size() == 1) { 
-                    if (isdigit(params[0][0]) ) {
-                        int id = stoi(params[0]); 
-                        board.select(id); 
-                        lastSelectedId = id;
-                        shapeSelected = true; 
-                    }
-                    else {
-                        cout << "Invalid ID.\n"; 
-                    }
+    string path;  // Reused file-name buffer
+    string input; // Reused line buffer for streamed input
+
+#ifndef _WIN32
+    // One server client. Its reader thread answers read-only commands from
+    // a snapshot itself and queues the rest; the command thread answers
+    // those. Snapshot reads only happen while nothing is queued for the
+    // client, so the two threads never write to the socket at once and the
+    // client always sees its own changes.
+    struct Connection {
+        int fd;
+        atomic<int> selection;  // The client's selected shape
+        atomic<int> pending;    // Queued commands not answered yet
+
+        explicit Connection(int socket) : fd(socket), selection(NO_SHAPE), pending(0) {}
+        ~Connection() { close(fd); }
+        void send(const string& text) {
+            size_t sent = 0;
+            while (sent < text.size()) {
+                ssize_t n = ::send(fd, text.data() + sent, text.size() - sent, 0);
+                if (n <= 0) {
+                    return; // Client went away; its reader thread notices
                 }
-                else if (params.size() == 2) { 
-                    int x, y;
-                    try {
-                        x = stoi(params[0]); 
-                        y = stoi(params[1]); 
-                        board.select(x, y); 
-                        if (shapeSelected) {
-                            lastSelectedId = board.getLastSelectedId(); 
-                        }
-                    }
-                    catch (const std::invalid_argument&) {
-                        cout << "Invalid coordinates.\n";
-                    }
-                    catch (const std::out_of_range&) {
-                        cout << "Coordinates out of range.\n"; 
-                    }
+                sent += n;
+            }
+        }
+    };
+    struct Request {
+        shared_ptr<Connection> client;
+        string line;
+    };
+    struct Reader {
+        thread worker;
+        shared_ptr<atomic<bool>> finished;  // Set as readClient returns
+    };
+
+    static const size_t MAX_REQUESTS_PER_PUBLISH = 256;
+
+    MpscQueue<Request> requests;
+    mutex clientsLock;  // Guards clients and readers
+    vector<weak_ptr<Connection>> clients;
+    vector<Reader> readers;
+
+    static bool isReadOnly(std::string_view command) {
+        return command == "list" || command == "select" || command == "draw" || command == "image";
+    }
+    // Runs one command with all of its output going to reply.
+    void executeFor(const string& line, atomic<int>& selection, ostream& reply) {
+        messages = &reply;
+        frames = &reply;
+        board.setMessages(reply, reply);
+        board.setSelection(selection);
+        execute(line);
+        selection = board.getLastSelectedId();
+    }
+    void acceptClients(int listener) {
+        pollfd watch = { listener, POLLIN, 0 };
+        while (!serverStopRequested) {
+            if (poll(&watch, 1, 200) <= 0) {
+                continue;
+            }
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            auto client = make_shared<Connection>(fd);
+            auto finished = make_shared<atomic<bool>>(false);
+            lock_guard<mutex> guard(clientsLock);
+            // Join the threads of clients that have left, so neither list
+            // grows with every connection
+            for (size_t i = 0; i < readers.size();) {
+                if (readers[i].finished->load(memory_order_acquire)) {
+                    readers[i].worker.join();
+                    readers[i] = std::move(readers.back());
+                    readers.pop_back();
                 }
                 else {
-                    cout << "Invalid selection parameters.\n"; 
+                    ++i;
                 }
             }
-            else if (command == "edit") {
-                string selection;
-                getline(cin, selection); 
-
-                stringstream ss(selection);
-                vector<string> params;
-                string param;
-                while (ss >> param) {
-                    params.push_back(param);
-                }
-                if (params.size() == 1) { 
-                    double param1 = stod(params[0]);
-                    board.edit(param1);
+            clients.erase(remove_if(clients.begin(), clients.end(), [](const weak_ptr<Connection>& weak) { return weak.expired(); }), clients.end());
+            clients.push_back(client);
+            readers.push_back({ thread(&CommandLine::readClient, this, client, finished), finished });
+        }
+    }
+    void readClient(shared_ptr<Connection> client, shared_ptr<atomic<bool>> finished) {
+        CommandLine view; // Mirrors published versions for read-only commands
+        view.serving = true;
+        uint64_t mirrored = 0;
+        bool mirroring = false;
+        EpochVersions<BoardSnapshot>& versions = board.publishedVersions();
+        int slot = versions.join(); // Without a slot, everything goes through the queue
+        string buffer;
+        char chunk[4096];
+        client->send("> ");
+        bool closing = false;
+        ssize_t n;
+        while (!closing && (n = recv(client->fd, chunk, sizeof(chunk), 0)) > 0) {
+            buffer.append(chunk, n);
+            size_t start = 0, eol;
+            while (!closing && (eol = buffer.find('\n', start)) != string::npos) {
+                string line = buffer.substr(start, eol - start);
+                start = eol + 1;
+                TokenCursor tokens(line);
+                std::string_view command;
+                tokens.next(command);
+                if (command == "exit") {
+                    shutdown(client->fd, SHUT_RDWR);
+                    closing = true;
+                    continue;
                 }
-                else if (params.size() == 2) { 
-                    double param1 = stod(params[0]); 
-                    double param2 = stod(params[1]);
-                    board.edit(param1, param2);
+                // Each client pans its own view, so view always runs here;
+                // queued, it would move the shared board's view instead
+                if (command == "view" && slot < 0) {
+                    client->send("Error: view is not available while all reader slots are taken.\n> ");
+                    continue;
                 }
-                else if (params.size() == 4) { 
-                    double param1 = stod(params[0]); 
-                    double param2 = stod(params[1]); 
-                    double param3 = stod(params[2]); 
-                    double param4 = stod(params[3]); 
-                    board.edit(param1, param2, param3, param4);
+                bool local = command == "view" || (isReadOnly(command) && client->pending.load(memory_order_acquire) == 0);
+                if (!local || slot < 0) {
+                    client->pending.fetch_add(1, memory_order_relaxed);
+                    requests.push({ client, std::move(line) });
+                    continue;
                 }
+                versions.read(slot, [&](const BoardSnapshot& current) {
+                    if (!mirroring || current.changes != mirrored) {
+                        view.board.mirror(current); // Shares its shape storage; safe to use after leaving
+                        mirrored = current.changes;
+                        mirroring = true;
+                    }
+                });
+                ostringstream reply;
+                view.executeFor(line, client->selection, reply);
+                reply << "> ";
+                client->send(reply.str());
             }
-            else if (command == "remove") {
-                if (board.getLastSelectedId() == -1) {
-                    cout << "No shape selected to remove.\n";
-                }
-                else {
-                    board.remove();
-                    lastSelectedId = -1;
-                    shapeSelected = false;
-                }
-                
+            buffer.erase(0, start);
+        }
+        if (slot >= 0) {
+            versions.leave(slot);
+        }
+        finished->store(true, memory_order_release);
+    }
+#endif
+public:
+    CommandLine() : messages(&cout), frames(&cout), batch(false), serving(false), drawPending(false), stopRequested(false), problem(nullptr) {}
+
+    // Interactive mode: one command per line, with a prompt before each.
+    void run() {
+        while (!stopRequested) {
+            say() << "> ";
+            if (!getline(cin, input)) {
+                break;
             }
-            else if (command == "move") {
-                int newX, newY;
-                cin >> newX >> newY; 
+            execute(input);
+        }
+    }
 
-                if (board.getLastSelectedId() == -1) {
-                    cout << "No shape selected.\n"; 
-                }
-                else {
-                    board.move(newX, newY); 
-                }
+    // Batch mode: runs a script ("-" for stdin) with one command per line,
+    // without prompts or per-command messages. Blank lines and lines
+    // starting with '#' are skipped. 'draw' only marks the board for
+    // printing, which happens once at the end or at an explicit 'flush'.
+    // A summary of failed commands and their line numbers goes to cerr.
+    // Returns true if every command succeeded.
+    bool runBatch(const string& script) {
+        std::ostream quiet(nullptr);
+        messages = &quiet;
+        board.setMessages(quiet, quiet);
+        batch = true;
+        drawPending = false;
+
+        BatchResult result;
+        bool opened = true;
+        if (script == "-") {
+            // Streamed line by line through one reused buffer
+            int lineNumber = 0;
+            while (!stopRequested && getline(cin, input)) {
+                runBatchLine(input, ++lineNumber, result);
             }
-            else if (command == "paint") {
-                string newColor;
-                cin >> newColor;
-                board.paint(newColor); 
+        }
+        else {
+            MappedFile file(script);
+            opened = file.isOpen();
+            std::string_view text(file.data(), file.size());
+            int lineNumber = 0;
+            while (opened && !text.empty() && !stopRequested) {
+                size_t eol = text.find('\n');
+                runBatchLine(text.substr(0, eol), ++lineNumber, result);
+                text.remove_prefix(eol == std::string_view::npos ? text.size() : eol + 1);
             }
-            else {
-                cout << "Unknown command.\n";
+        }
+        if (drawPending) {
+            printBoard();
+        }
+        batch = false;
+        stopRequested = false;
+        messages = &cout;
+        board.setMessages(cout, cerr);
+
+        if (!opened) {
+            cerr << "Error: Could not open file for reading.\n";
+            return false;
+        }
+        string source = script == "-" ? "stdin" : script;
+        cerr << "Batch " << source << ": " << result.commands << " commands, " << result.failedLines.size() << " failed";
+        for (size_t i = 0; i < result.failedLines.size() && i < MAX_REPORTED_LINES; ++i) {
+            cerr << (i == 0 ? " (lines " : ", ") << result.failedLines[i];
+        }
+        if (result.failedLines.size() > MAX_REPORTED_LINES) {
+            cerr << ", ...";
+        }
+        cerr << (result.failedLines.empty() ? ".\n" : ").\n");
+        return result.failedLines.empty();
+    }
+
+    // Server mode: listens on a Unix domain socket and lets any number of
+    // clients edit the board, one command per line, each with its own
+    // selection. Changes go through a lock-free queue to this thread, the
+    // only one that touches the board; list, select, draw and image are
+    // answered by the clients' threads from the latest published version.
+    // Stops on SIGINT or SIGTERM.
+    bool serve(const string& socketPath) {
+#ifdef _WIN32
+        cerr << "Error: server mode needs Unix domain sockets.\n";
+        return false;
+#else
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            cerr << "Error: socket path is too long.\n";
+            return false;
+        }
+        memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        struct stat existing;
+        if (stat(socketPath.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+            unlink(socketPath.c_str()); // Left behind by an earlier server
+        }
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+            cerr << "Error: Could not listen on " << socketPath << ".\n";
+            if (listener >= 0) {
+                close(listener);
+            }
+            return false;
+        }
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, requestServerStop);
+        signal(SIGTERM, requestServerStop);
+        serving = true;
+        board.publishVersion();
+        cerr << "Serving the board on " << socketPath << ".\n";
+
+        thread acceptor(&CommandLine::acceptClients, this, listener);
+        vector<pair<shared_ptr<Connection>, string>> replies;
+        Request request;
+        while (!serverStopRequested) {
+            requests.wait(chrono::milliseconds(200));
+            // Run a batch of commands, publish once, then answer; a client's
+            // next read must find its changes in the snapshot
+            while (replies.size() < MAX_REQUESTS_PER_PUBLISH && requests.pop(request)) {
+                ostringstream reply;
+                executeFor(request.line, request.client->selection, reply);
+                reply << "> ";
+                replies.emplace_back(std::move(request.client), reply.str());
+            }
+            board.publishVersion();
+            for (auto& answered : replies) {
+                answered.first->send(answered.second);
+                answered.first->pending.fetch_sub(1, memory_order_release);
             }
+            replies.clear();
         }
+
+        acceptor.join();
+        close(listener);
+        unlink(socketPath.c_str());
+        {
+            lock_guard<mutex> guard(clientsLock);
+            for (const weak_ptr<Connection>& weak : clients) {
+                if (shared_ptr<Connection> client = weak.lock()) {
+                    shutdown(client->fd, SHUT_RDWR);
+                }
+            }
+        }
+        for (Reader& reader : readers) {
+            reader.worker.join();
+        }
+        while (requests.pop(request)) {}
+        serving = false;
+        messages = &cout;
+        frames = &cout;
+        board.setMessages(cout, cerr);
+        cerr << "Server stopped.\n";
+        return true;
+#endif
     }
 };
 
-int main() {
+// The benchmarks build this file with SHAPES_BLACKBOARD_NO_MAIN and drive
+// Board directly.
+#ifndef SHAPES_BLACKBOARD_NO_MAIN
+int main(int argc, char* argv[]) {
    
+    std::ios::sync_with_stdio(false);
     CommandLine cmd;
+    if (argc > 1 && string(argv[1]) == "--batch") {
+        // extended_ShapesBlackBoard --batch [script], stdin if no script is given
+        return cmd.runBatch(argc > 2 ? argv[2] : "-") ? 0 : 1;
+    }
+    if (argc > 2 && string(argv[1]) == "--serve") {
+        // extended_ShapesBlackBoard --serve socket-path
+        return cmd.serve(argv[2]) ? 0 : 1;
+    }
     cmd.run();
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
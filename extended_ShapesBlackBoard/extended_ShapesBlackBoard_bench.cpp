@@ -0,0 +1,321 @@
+﻿// Benchmarks for the board's hot paths: add, draw, select, save and load.
+// The program is compiled in with its main() left out and Board is driven
+// directly on a synthetic board. Results go out as JSON so runs can be
+// compared.
+//
+//   extended_ShapesBlackBoard_bench [--shapes N] [--mix t,c,s,r,l]
+//       [--size MIN MAX] [--overlap D | --board W H] [--warmup N]
+//       [--reps N] [--selects N] [--seed N] [--ops add,draw,...]
+//       [--file PATH] [--out FILE]
+//
+// --mix weighs the shape types (triangle, circle, square, rectangle, line).
+// --overlap sets how many shapes cover an average cell; the board is sized
+// to match unless --board gives its size.
+#define SHAPES_BLACKBOARD_NO_MAIN
+#include "extended_ShapesBlackBoard.cpp"
+#include <random>
+#include <streambuf>
+
+struct BenchConfig {
+    int shapes = 10000;
+    double mix[5] = { 1, 1, 1, 1, 1 };  // Weights in ShapeKind order
+    int minSize = 2;
+    int maxSize = 12;
+    double overlap = 1.0;
+    int width = 0;                      // 0: derived from overlap
+    int height = 0;
+    int warmup = 2;
+    int reps = 10;
+    int selects = 1000;                 // Points picked per select repetition
+    unsigned seed = 1;
+    vector<string> ops = { "add", "draw", "select", "save", "load" };
+    string file = "bench_board.sav";
+    string out;                         // Empty: stdout
+};
+
+struct BenchShape {
+    GeometryKey key;
+    ShapeStyle style;
+};
+
+// Timings of one operation, one sample per repetition.
+struct BenchResult {
+    string op;
+    int items;              // Work items per repetition (shapes, picks, ...)
+    vector<double> millis;
+};
+
+// Discards everything written to it.
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+double shapeArea(const GeometryKey& key) {
+    switch (key.kind) {
+    case ShapeKind::Triangle: return key.a * key.a;
+    case ShapeKind::Circle: return PI * key.a * key.a;
+    case ShapeKind::Square: return key.a * key.a;
+    case ShapeKind::Rectangle: return key.a * key.b;
+    default: return max(fabs(key.a - key.x), fabs(key.b - key.y)) + 1;
+    }
+}
+
+// Random shapes in a board sized so that they cover each cell config.overlap
+// times on average. Sets config.width and config.height if they are 0.
+vector<BenchShape> generateShapes(BenchConfig& config) {
+    std::mt19937 random(config.seed);
+    std::discrete_distribution<int> kinds(std::begin(config.mix), std::end(config.mix));
+    std::uniform_int_distribution<int> sizes(config.minSize, config.maxSize);
+    static const char* const colors[] = { "red", "green", "yellow", "blue", "magenta", "cyan", "white" };
+    std::uniform_int_distribution<int> colorPick(0, 6);
+    std::uniform_int_distribution<int> fillPick(0, 1);
+
+    // Sizes first: the board size depends on the total area
+    vector<BenchShape> shapes(config.shapes);
+    double area = 0;
+    for (BenchShape& shape : shapes) {
+        shape.key = { static_cast<ShapeKind>(kinds(random)), 0, 0, static_cast<double>(sizes(random)), 0 };
+        if (shape.key.kind == ShapeKind::Rectangle) {
+            shape.key.b = sizes(random);
+        }
+        else if (shape.key.kind == ShapeKind::Line) {
+            // End point offset from the start; made absolute below
+            double length = shape.key.a;
+            shape.key.a = fillPick(random) ? length : -length;
+            shape.key.b = sizes(random) - config.minSize;
+        }
+        palette().intern(colors[colorPick(random)], fillPick(random) ? "fill" : "frame", shape.style);
+        area += shapeArea(shape.key);
+    }
+    if (config.width <= 0 || config.height <= 0) {
+        // Twice as wide as high, like a terminal
+        double cells = max(1.0, area / config.overlap);
+        config.height = max(1, static_cast<int>(sqrt(cells / 2)));
+        config.width = max(1, static_cast<int>(cells / config.height));
+    }
+
+    std::uniform_int_distribution<int> xs(0, config.width - 1);
+    std::uniform_int_distribution<int> ys(0, config.height - 1);
+    for (BenchShape& shape : shapes) {
+        shape.key.x = xs(random);
+        shape.key.y = ys(random);
+        if (shape.key.kind == ShapeKind::Line) {
+            shape.key.a += shape.key.x;
+            shape.key.b += shape.key.y;
+        }
+    }
+    return shapes;
+}
+
+void addShapes(Board& board, const vector<BenchShape>& shapes) {
+    for (const BenchShape& shape : shapes) {
+        const GeometryKey& k = shape.key;
+        switch (k.kind) {
+        case ShapeKind::Triangle: board.addTriangle(k.x, k.y, k.a, shape.style); break;
+        case ShapeKind::Circle: board.addCircle(k.x, k.y, k.a, shape.style); break;
+        case ShapeKind::Square: board.addSquare(k.x, k.y, k.a, shape.style); break;
+        case ShapeKind::Rectangle: board.addRectangle(k.x, k.y, k.a, k.b, shape.style); break;
+        case ShapeKind::Line: board.addLine(k.x, k.y, static_cast<int>(k.a), static_cast<int>(k.b), shape.style); break;
+        }
+    }
+}
+
+// Runs setup() then work() warmup + reps times, timing only work().
+template <typename Setup, typename Work>
+vector<double> timeRuns(const BenchConfig& config, Setup&& setup, Work&& work) {
+    vector<double> millis;
+    for (int run = 0; run < config.warmup + config.reps; ++run) {
+        setup();
+        auto start = chrono::steady_clock::now();
+        work();
+        chrono::duration<double, std::milli> elapsed = chrono::steady_clock::now() - start;
+        if (run >= config.warmup) {
+            millis.push_back(elapsed.count());
+        }
+    }
+    return millis;
+}
+
+// Nearest-rank percentile of sorted samples
+double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = static_cast<size_t>(ceil(p / 100 * sorted.size()));
+    return sorted[min(sorted.size(), max<size_t>(rank, 1)) - 1];
+}
+
+void writeJson(ostream& out, const BenchConfig& config, const vector<BenchResult>& results) {
+    out << "{\n  \"config\": {\"shapes\": " << config.shapes << ", \"mix\": [";
+    for (int k = 0; k < 5; ++k) {
+        out << (k ? ", " : "") << config.mix[k];
+    }
+    out << "], \"min_size\": " << config.minSize << ", \"max_size\": " << config.maxSize
+        << ", \"overlap\": " << config.overlap << ", \"board\": [" << config.width << ", " << config.height << "]"
+        << ", \"warmup\": " << config.warmup << ", \"reps\": " << config.reps
+        << ", \"selects\": " << config.selects << ", \"seed\": " << config.seed << "},\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        vector<double> sorted = results[i].millis;
+        sort(sorted.begin(), sorted.end());
+        double total = 0;
+        for (double m : sorted) {
+            total += m;
+        }
+        double mean = sorted.empty() ? 0 : total / sorted.size();
+        out << (i ? ",\n" : "\n") << "    {\"op\": \"" << results[i].op << "\", \"items\": " << results[i].items
+            << ", \"unit\": \"ms\", \"min\": " << percentile(sorted, 0) << ", \"p50\": " << percentile(sorted, 50)
+            << ", \"p90\": " << percentile(sorted, 90) << ", \"p99\": " << percentile(sorted, 99)
+            << ", \"max\": " << (sorted.empty() ? 0 : sorted.back()) << ", \"mean\": " << mean
+            << ", \"ns_per_item\": " << (results[i].items > 0 ? percentile(sorted, 50) * 1e6 / results[i].items : 0) << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+bool parseArguments(int argc, char* argv[], BenchConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto value = [&](int ahead) { return i + ahead < argc ? argv[i + ahead] : nullptr; };
+        if (arg == "--shapes" && value(1)) config.shapes = atoi(argv[++i]);
+        else if (arg == "--size" && value(2)) {
+            config.minSize = atoi(argv[++i]);
+            config.maxSize = atoi(argv[++i]);
+        }
+        else if (arg == "--overlap" && value(1)) config.overlap = atof(argv[++i]);
+        else if (arg == "--board" && value(2)) {
+            config.width = atoi(argv[++i]);
+            config.height = atoi(argv[++i]);
+        }
+        else if (arg == "--warmup" && value(1)) config.warmup = atoi(argv[++i]);
+        else if (arg == "--reps" && value(1)) config.reps = atoi(argv[++i]);
+        else if (arg == "--selects" && value(1)) config.selects = atoi(argv[++i]);
+        else if (arg == "--seed" && value(1)) config.seed = static_cast<unsigned>(atoi(argv[++i]));
+        else if (arg == "--file" && value(1)) config.file = argv[++i];
+        else if (arg == "--out" && value(1)) config.out = argv[++i];
+        else if (arg == "--mix" && value(1)) {
+            stringstream weights(argv[++i]);
+            string weight;
+            for (int k = 0; k < 5; ++k) {
+                config.mix[k] = getline(weights, weight, ',') ? atof(weight.c_str()) : 0;
+            }
+        }
+        else if (arg == "--ops" && value(1)) {
+            config.ops.clear();
+            stringstream names(argv[++i]);
+            string name;
+            while (getline(names, name, ',')) {
+                config.ops.push_back(name);
+            }
+        }
+        else {
+            cerr << "Unknown or incomplete option " << arg << ".\n";
+            return false;
+        }
+    }
+    if (config.shapes < 0 || config.minSize < 1 || config.maxSize < config.minSize || config.overlap <= 0 ||
+        config.warmup < 0 || config.reps < 1 || config.selects < 1) {
+        cerr << "Invalid benchmark settings.\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    if (!parseArguments(argc, argv, config)) {
+        return 2;
+    }
+    vector<BenchShape> shapes = generateShapes(config);
+    if (static_cast<long long>(config.width) * config.height > MAX_BOARD_CELLS) {
+        cerr << "Board of " << config.width << "x" << config.height << " is too large; lower --shapes or raise --overlap.\n";
+        return 2;
+    }
+
+    // Board messages and terminal output are timed but not shown
+    NullBuffer discard;
+    std::ostream quiet(&discard);
+    std::streambuf* console = cout.rdbuf(&discard);
+
+    unique_ptr<Board> board;
+    auto freshBoard = [&]() {
+        board.reset(new Board());
+        board->setMessages(quiet, quiet);
+        board->resize(config.width, config.height);
+    };
+    auto filledBoard = [&]() {
+        if (!board) {
+            freshBoard();
+            addShapes(*board, shapes);
+        }
+    };
+
+    vector<BenchResult> results;
+    std::mt19937 random(config.seed + 1);
+    for (const string& op : config.ops) {
+        BenchResult result = { op, 0, {} };
+        if (op == "add") {
+            // isOccupied-gated adds onto an empty board
+            result.items = config.shapes;
+            result.millis = timeRuns(config, freshBoard, [&]() { addShapes(*board, shapes); });
+            board.reset();
+        }
+        else if (op == "draw") {
+            // Full redraw and print, as after 'resize' or 'load'
+            filledBoard();
+            result.items = config.width * config.height;
+            result.millis = timeRuns(config, [&]() { board->invalidateAll(); }, [&]() {
+                board->draw();
+                board->print();
+            });
+        }
+        else if (op == "select") {
+            filledBoard();
+            board->draw(); // Picking reads the shape-ID buffer a draw leaves behind
+            result.items = config.selects;
+            vector<pair<int, int>> points(config.selects);
+            std::uniform_int_distribution<int> xs(0, config.width - 1), ys(0, config.height - 1);
+            result.millis = timeRuns(config, [&]() {
+                for (auto& point : points) {
+                    point = { xs(random), ys(random) };
+                }
+            }, [&]() {
+                for (const auto& point : points) {
+                    board->select(point.first, point.second);
+                }
+            });
+        }
+        else if (op == "save") {
+            filledBoard();
+            result.items = config.shapes;
+            result.millis = timeRuns(config, []() {}, [&]() { board->save(config.file); });
+        }
+        else if (op == "load") {
+            filledBoard();
+            board->save(config.file);
+            result.items = config.shapes;
+            result.millis = timeRuns(config, []() {}, [&]() { board->load(config.file); });
+        }
+        else {
+            cout.rdbuf(console);
+            cerr << "Unknown operation " << op << ".\n";
+            return 2;
+        }
+        results.push_back(result);
+    }
+    board.reset();
+    std::remove(config.file.c_str());
+    cout.rdbuf(console);
+
+    if (config.out.empty()) {
+        writeJson(cout, config, results);
+        return 0;
+    }
+    ofstream file(config.out);
+    writeJson(file, config, results);
+    if (!file) {
+        cerr << "Error: Could not write " << config.out << ".\n";
+        return 1;
+    }
+    return 0;
+}